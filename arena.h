@@ -0,0 +1,102 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+#include <vector>
+
+// Bump allocator for data that dies all at once: allocating moves a pointer
+// through a list of blocks, deallocating does nothing, and reset() makes
+// the whole arena free again while keeping its blocks for the next round.
+// With bumping turned off every allocation goes to the heap instead, still
+// counted, so the two can be compared. Not thread safe.
+class Arena : public std::pmr::memory_resource {
+public:
+    struct Stats {
+        size_t allocations = 0;     // allocate() calls
+        size_t bytes = 0;           // bytes requested by them
+        size_t highWater = 0;       // most bytes requested between two resets
+        size_t blocks = 0;          // blocks taken from the heap
+        size_t resets = 0;
+    };
+
+    explicit Arena(size_t blockSize = 1 << 16) : blockSize(blockSize), current(0), offset(0), inUse(0), bumping(true) {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() {
+        release();
+    }
+
+    // Only to be changed while nothing allocated from the arena is alive.
+    void setBumping(bool enabled) {
+        bumping = enabled;
+    }
+    void reset() {
+        current = 0;
+        offset = 0;
+        inUse = 0;
+        counters.resets++;
+    }
+    // Like reset(), but also hands the blocks back to the heap. The
+    // counters are kept.
+    void release() {
+        for (const Block& block : blocks)
+            ::operator delete(block.data);
+        blocks.clear();
+        current = 0;
+        offset = 0;
+        inUse = 0;
+    }
+    const Stats& stats() const {
+        return counters;
+    }
+
+private:
+    struct Block {
+        char* data;
+        size_t size;
+    };
+    std::vector<Block> blocks;
+    size_t blockSize;
+    size_t current;             // block being bumped through
+    size_t offset;              // next free byte in it
+    size_t inUse;
+    bool bumping;
+    Stats counters;
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        counters.allocations++;
+        counters.bytes += bytes;
+        inUse += bytes;
+        counters.highWater = std::max(counters.highWater, inUse);
+        if (!bumping)
+            return ::operator new(bytes, std::align_val_t(alignment));
+        // Block starts are aligned for any fundamental type, so offsets
+        // only need aligning within the block.
+        while (true) {
+            for (; current < blocks.size(); current++, offset = 0) {
+                size_t start = (offset + alignment - 1) & ~(alignment - 1);
+                if (start + bytes <= blocks[current].size) {
+                    offset = start + bytes;
+                    return blocks[current].data + start;
+                }
+            }
+            // Blocks double, so a round that needs much more memory than
+            // the last one takes few new blocks.
+            size_t size = std::max(blocks.empty() ? blockSize : blocks.back().size * 2, bytes);
+            blocks.push_back({static_cast<char*>(::operator new(size)), size});
+            counters.blocks++;
+        }
+    }
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        if (!bumping)
+            ::operator delete(p, bytes, std::align_val_t(alignment));
+    }
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+};
+
+#endif
@@ -0,0 +1,1002 @@
+// Micro-benchmarks for the evaluation engine.
+//
+//   g++ -std=c++17 -O2 -o benchmark benchmark.cpp scanner.cpp
+//   g++ -std=c++17 -O1 -g -fsanitize=thread -o benchmark benchmark.cpp scanner.cpp   (for threaded)
+//   ./benchmark join [--nested-limit N] [--threads N] [sizes...]
+//   ./benchmark parse [--vector-limit N] [--threads N] [sizes...]
+//   ./benchmark ingest [--vector-limit N] [sizes...]
+//   ./benchmark demand [sizes...]
+//   ./benchmark closure [sizes...]
+//   ./benchmark snapshot [sizes...]
+//   ./benchmark incremental [--updates N] [sizes...]
+//   ./benchmark output [sizes...]
+//   ./benchmark threaded [--threads N] [programs...]
+//   ./benchmark engines [programs...]
+//   ./benchmark suite [--scale N] [--threads N] [--no-arena] [--json PATH] [--baseline PATH]
+//                     [--profile PREFIX]
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include "interpreter.cpp"
+
+using namespace std;
+
+static double secondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static string quoted(const string& prefix, size_t number) {
+    return "'" + prefix + to_string(number) + "'";
+}
+
+// R(A,B) and S(B,C) with n tuples each; every R tuple matches one S tuple.
+static void benchmarkJoin(size_t n, size_t nestedLimit, ThreadPool* pool) {
+    Relation left("R", Scheme({"A", "B"}));
+    Relation right("S", Scheme({"B", "C"}));
+    for (size_t i = 0; i < n; i++) {
+        left.addTuple(Tuple({quoted("a", i), quoted("k", i)}));
+        right.addTuple(Tuple({quoted("k", (i * 7) % n), quoted("c", i)}));
+    }
+
+    auto start = chrono::steady_clock::now();
+    Relation hashed = left.join(right);
+    double hashSeconds = secondsSince(start);
+    cout << "join n=" << n << " hash: " << hashSeconds << "s (" << hashed.size() << " tuples)";
+
+    if (pool) {
+        Relation::setParallelJoin(pool, 0);
+        start = chrono::steady_clock::now();
+        Relation partitioned = left.join(right);
+        double partitionedSeconds = secondsSince(start);
+        Relation::setParallelJoin(nullptr, 0);
+        cout << " partitioned(" << pool->size() << " threads): " << partitionedSeconds << "s";
+        if (!partitioned.hasSameTuples(hashed))
+            cout << " MISMATCH";
+    }
+
+    if (n <= nestedLimit) {
+        start = chrono::steady_clock::now();
+        Relation nested = left.joinNestedLoop(right);
+        double nestedSeconds = secondsSince(start);
+        cout << " nested-loop: " << nestedSeconds << "s";
+        if (!nested.hasSameTuples(hashed))
+            cout << " MISMATCH";
+        else
+            cout << " speedup: " << nestedSeconds / hashSeconds << "x";
+    } else {
+        cout << " nested-loop: skipped (above --nested-limit)";
+    }
+    cout << "\n";
+}
+
+// A program with one scheme and n three-column facts.
+static string syntheticFacts(size_t n) {
+    string program = "Schemes:\n  edge(A,B,C)\nFacts:\n";
+    program.reserve(program.size() + n * 40);
+    for (size_t i = 0; i < n; i++)
+        program += "  edge(" + quoted("a", i) + "," + quoted("b", i % 1000) + "," + quoted("c", i * 7 % n) + ").\n";
+    program += "Rules:\nQueries:\n  edge('a0',B,C)?\n";
+    return program;
+}
+
+class CountingSink : public FactSink {
+public:
+    size_t facts = 0;
+    void addFact(const Predicate&) override {
+        facts++;
+    }
+};
+
+static void benchmarkParse(size_t n, size_t vectorLimit, ThreadPool* pool) {
+    string program = syntheticFacts(n);
+    cout << "parse n=" << n << " (" << program.size() / (1 << 20) << " MB)";
+
+    if (pool) {
+        // A tail with a comment, an unknown character and an unterminated
+        // string, so that the warnings are compared as well.
+        string input = program + "# comment\n  $ edge('a\n";
+        ostringstream sequentialWarnings, parallelWarnings;
+        streambuf* saved = cerr.rdbuf(sequentialWarnings.rdbuf());
+        auto start = chrono::steady_clock::now();
+        Scanner sequential(input);
+        sequential.scan();
+        double sequentialSeconds = secondsSince(start);
+        cerr.rdbuf(parallelWarnings.rdbuf());
+        start = chrono::steady_clock::now();
+        Scanner parallel(input);
+        parallel.scan(*pool);
+        double parallelSeconds = secondsSince(start);
+        cerr.rdbuf(saved);
+        cout << " scan: " << sequentialSeconds << "s parallel(" << pool->size() << " threads): "
+             << parallelSeconds << "s";
+        // Token::toString() has the type, the lexeme and the line number.
+        const vector<Token>& expected = sequential.getTokens();
+        const vector<Token>& actual = parallel.getTokens();
+        bool same = actual.size() == expected.size() && parallelWarnings.str() == sequentialWarnings.str();
+        for (size_t t = 0; t < expected.size() && same; t++)
+            same = actual[t].toString() == expected[t].toString();
+        if (!same)
+            cout << " MISMATCH";
+    }
+
+    if (n <= vectorLimit) {
+        auto start = chrono::steady_clock::now();
+        Scanner scanner(program);
+        scanner.scan();
+        Parser parser(scanner.getTokens());
+        parser.parse();
+        double seconds = secondsSince(start);
+        cout << " tokens+parse: " << seconds << "s (" << size_t(n / seconds) << " facts/s)";
+        if (parser.datalogProgram.facts.size() != n)
+            cout << " MISMATCH";
+    } else {
+        cout << " tokens+parse: skipped (above --vector-limit)";
+    }
+
+    istringstream in(program);
+    auto start = chrono::steady_clock::now();
+    StreamScanner scanner(in);
+    Parser parser(scanner);
+    CountingSink sink;
+    parser.setFactSink(&sink);
+    parser.parse();
+    double seconds = secondsSince(start);
+    cout << " streamed: " << seconds << "s (" << size_t(n / seconds) << " facts/s)";
+    if (sink.facts != n)
+        cout << " MISMATCH";
+    cout << "\n";
+}
+
+static void writeFile(const string& path, const string& contents) {
+    ofstream out(path, ios::binary | ios::trunc);
+    out << contents;
+}
+
+// The same n rows loaded from Datalog text and from a CSV file, each into
+// a fresh symbol table.
+static void benchmarkIngest(size_t n, size_t vectorLimit) {
+    const string csvPath = "benchmark-ingest.csv";
+    const string textPath = "benchmark-ingest.dl";
+    string csv;
+    csv.reserve(n * 30);
+    for (size_t i = 0; i < n; i++)
+        csv += "a" + to_string(i) + ",b" + to_string(i % 1000) + ",c" + to_string(i * 7 % n) + "\n";
+    writeFile(csvPath, csv);
+    cout << "ingest n=" << n;
+
+    DatalogProgram schemes;
+    Predicate edge("edge");
+    for (const char* attribute : {"A", "B", "C"})
+        edge.addParameter(Parameter(attribute));
+    schemes.addScheme(edge);
+    SymbolTable::global() = SymbolTable();
+    auto start = chrono::steady_clock::now();
+    Interpreter direct(schemes);
+    size_t added = direct.loadDelimited("edge", csvPath, ',');
+    double csvSeconds = secondsSince(start);
+    cout << " csv: " << csvSeconds << "s (" << size_t(n / csvSeconds) << " rows/s)";
+    if (added != n)
+        cout << " MISMATCH";
+
+    if (n <= vectorLimit) {
+        writeFile(textPath, syntheticFacts(n));
+        SymbolTable::global() = SymbolTable();
+        start = chrono::steady_clock::now();
+        Scanner scanner{MappedFile(textPath)};
+        scanner.scan();
+        Parser parser(scanner.getTokens());
+        parser.parse();
+        Interpreter text(parser.datalogProgram);
+        text.loadProgram();
+        double textSeconds = secondsSince(start);
+        cout << " text: " << textSeconds << "s (" << size_t(n / textSeconds) << " rows/s)"
+             << " speedup: " << textSeconds / csvSeconds << "x";
+        remove(textPath.c_str());
+    } else {
+        cout << " text: skipped (above --vector-limit)";
+    }
+    remove(csvPath.c_str());
+    cout << "\n";
+}
+
+// Runs interpret() with its output captured, and returns all of it.
+static string interpretOutput(Interpreter& interpreter) {
+    ostringstream output;
+    streambuf* saved = cout.rdbuf(output.rdbuf());
+    interpreter.interpret();
+    cout.rdbuf(saved);
+    return output.str();
+}
+
+// The same, but only the answers.
+static string interpretAnswers(Interpreter& interpreter) {
+    string text = interpretOutput(interpreter);
+    return text.substr(text.find("Query Evaluation"));
+}
+
+static string queryAnswers(const DatalogProgram& program, bool demandDriven, double& seconds) {
+    auto start = chrono::steady_clock::now();
+    Interpreter interpreter(program);
+    interpreter.setDemandDriven(demandDriven);
+    string answers = interpretAnswers(interpreter);
+    seconds = secondsSince(start);
+    return answers;
+}
+
+// Transitive closure over n nodes in chains of 200, queried from both ends
+// of the first chain only: the answers are a 1/(n/200) slice of the
+// closure, which the full evaluation computes whole.
+static void benchmarkDemand(size_t n) {
+    const size_t length = 200;
+    string text = "Schemes:\n  edge(A,B)\n  path(A,B)\nFacts:\n";
+    for (size_t i = 0; i + 1 < n; i++)
+        if ((i + 1) % length != 0)
+            text += "  edge(" + quoted("n", i) + "," + quoted("n", i + 1) + ").\n";
+    text += "Rules:\n  path(X,Y) :- edge(X,Y).\n  path(X,Z) :- edge(X,Y),path(Y,Z).\n";
+    text += "Queries:\n  path(" + quoted("n", 0) + ",X)?\n  path(X," + quoted("n", length - 1) + ")?\n";
+    Scanner scanner(text);
+    scanner.scan();
+    Parser parser(scanner.getTokens());
+    parser.parse();
+
+    double fullSeconds, demandSeconds;
+    string full = queryAnswers(parser.datalogProgram, false, fullSeconds);
+    string demand = queryAnswers(parser.datalogProgram, true, demandSeconds);
+    cout << "demand n=" << n << " full: " << fullSeconds << "s demand-driven: " << demandSeconds
+         << "s speedup: " << fullSeconds / demandSeconds << "x";
+    if (full != demand)
+        cout << " MISMATCH";
+    cout << "\n";
+}
+
+// Transitive closure over n nodes in chains of 200, evaluated and saved
+// as a snapshot the way server --save-snapshot does, then loaded into a
+// fresh symbol table as server --snapshot does. The answers must match.
+static void benchmarkSnapshot(size_t n) {
+    const string path = "benchmark-snapshot.bin";
+    string text = "Schemes:\n  edge(A,B)\n  path(A,B)\nFacts:\n";
+    for (size_t i = 0; i + 1 < n; i++)
+        if ((i + 1) % 200 != 0)
+            text += "  edge(" + quoted("n", i) + "," + quoted("n", i + 1) + ").\n";
+    text += "Rules:\n  path(X,Y) :- edge(X,Y).\n  path(X,Z) :- edge(X,Y),path(Y,Z).\n";
+    text += "Queries:\n  path(" + quoted("n", 0) + ",X)?\n  path(X,Y)?\n  edge(X,X)?\n";
+    Scanner scanner(text);
+    scanner.scan();
+    Parser parser(scanner.getTokens());
+    parser.parse();
+
+    SymbolTable::global() = SymbolTable();
+    auto start = chrono::steady_clock::now();
+    Interpreter evaluated(parser.datalogProgram);
+    string expected = interpretAnswers(evaluated);
+    double evaluateSeconds = secondsSince(start);
+    start = chrono::steady_clock::now();
+    evaluated.saveSnapshot(path);
+    double saveSeconds = secondsSince(start);
+
+    SymbolTable::global() = SymbolTable();
+    start = chrono::steady_clock::now();
+    Interpreter loaded;
+    loaded.loadSnapshot(path);
+    double loadSeconds = secondsSince(start);
+    string answers = interpretAnswers(loaded);
+    cout << "snapshot n=" << n << " evaluate: " << evaluateSeconds << "s save: " << saveSeconds
+         << "s load: " << loadSeconds << "s speedup: " << evaluateSeconds / loadSeconds << "x";
+    if (answers != expected)
+        cout << " MISMATCH";
+    cout << "\n";
+    remove(path.c_str());
+}
+
+// Transitive closure of a single chain of n nodes: n passes, each adding
+// one row of the closure, so the total work of a semi-naive evaluation is
+// about n^2 and a size that doubles should take about four times as long.
+// Per-pass work that follows the size of the relations rather than of the
+// delta adds a power of n and shows up as a growth exponent near 3.
+static void benchmarkClosure(const vector<size_t>& sizes) {
+    size_t previousN = 0;
+    double previousSeconds = 0;
+    for (size_t n : sizes) {
+        string text = "Schemes:\n  edge(A,B)\n  path(A,B)\nFacts:\n";
+        for (size_t i = 0; i + 1 < n; i++)
+            text += "  edge(" + quoted("n", i) + "," + quoted("n", i + 1) + ").\n";
+        text += "Rules:\n  path(X,Y) :- edge(X,Y).\n  path(X,Z) :- edge(X,Y),path(Y,Z).\n";
+        text += "Queries:\n  path(" + quoted("n", 0) + ",X)?\n";
+        Scanner scanner(text);
+        scanner.scan();
+        Parser parser(scanner.getTokens());
+        parser.parse();
+
+        double seconds;
+        queryAnswers(parser.datalogProgram, false, seconds);
+        cout << "closure n=" << n << " semi-naive: " << seconds << "s";
+        if (previousN > 0 && previousSeconds > 0 && n > previousN) {
+            double exponent = log(seconds / previousSeconds) / log(static_cast<double>(n) / previousN);
+            cout << " growth: n^" << exponent;
+            if (exponent > 2.8)
+                cout << " SUPERQUADRATIC";
+        }
+        cout << "\n";
+        previousN = n;
+        previousSeconds = seconds;
+    }
+}
+
+// Counts and hashes what is written to it instead of keeping it, so that
+// the output of different runs can be compared at any size.
+class DiscardingBuffer : public streambuf {
+public:
+    size_t bytes = 0;
+    uint64_t hash = 14695981039346656037ull;
+protected:
+    streamsize xsputn(const char* text, streamsize count) override {
+        for (streamsize i = 0; i < count; i++)
+            hash = (hash ^ static_cast<unsigned char>(text[i])) * 1099511628211ull;
+        bytes += count;
+        return count;
+    }
+    int_type overflow(int_type c) override {
+        if (c != traits_type::eof()) {
+            char value = c;
+            xsputn(&value, 1);
+        }
+        return c;
+    }
+};
+
+// A rule copying n facts and a query for all of them, so that nearly all
+// of the time goes into writing 2n tuples, in each output format.
+static void benchmarkOutput(size_t n) {
+    string text = "Schemes:\n  edge(A,B)\n  copy(A,B)\nFacts:\n";
+    for (size_t i = 0; i < n; i++)
+        text += "  edge(" + quoted("n", i) + "," + quoted("n", (i * 7 + 1) % n) + ").\n";
+    text += "Rules:\n  copy(X,Y) :- edge(X,Y).\nQueries:\n  copy(X,Y)?\n";
+    Scanner scanner(text);
+    scanner.scan();
+    Parser parser(scanner.getTokens());
+    parser.parse();
+
+    struct Mode {
+        const char* name;
+        OutputFormat format;
+        bool background;
+    };
+    const Mode modes[] = {
+        {"readable", READABLE_OUTPUT, false}, {"background", READABLE_OUTPUT, true},
+        {"tsv", TSV_OUTPUT, false}, {"summary", SUMMARY_OUTPUT, false},
+    };
+    cout << "output n=" << n;
+    uint64_t readableHash = 0;
+    for (const Mode& mode : modes) {
+        DiscardingBuffer sink;
+        streambuf* saved = cout.rdbuf(&sink);
+        auto start = chrono::steady_clock::now();
+        {
+            Interpreter interpreter(parser.datalogProgram);
+            interpreter.setOutputFormat(mode.format);
+            interpreter.setBackgroundOutput(mode.background);
+            interpreter.interpret();
+        }
+        double seconds = secondsSince(start);
+        cout.rdbuf(saved);
+        cout << " " << mode.name << ": " << seconds << "s";
+        if (mode.format != SUMMARY_OUTPUT)
+            cout << " (" << sink.bytes / double(1 << 20) / seconds << " MB/s)";
+        if (mode.format == READABLE_OUTPUT && !mode.background)
+            readableHash = sink.hash;
+        else if (mode.format == READABLE_OUTPUT && sink.hash != readableHash)
+            cout << " MISMATCH";
+    }
+    cout << "\n";
+}
+
+// A small random program: up to five relations over a few constants, half
+// of them with facts, and up to six rules joining up to three atoms each.
+static string randomProgram(mt19937& random) {
+    auto pick = [&](size_t n) { return size_t(random() % n); };
+    size_t relations = 2 + pick(4);
+    vector<size_t> arity;
+    string text = "Schemes:\n";
+    for (size_t i = 0; i < relations; i++) {
+        arity.push_back(1 + pick(3));
+        text += "  r" + to_string(i) + "(";
+        for (size_t c = 0; c < arity[i]; c++)
+            text += (c ? ",C" : "C") + to_string(c);
+        text += ")\n";
+    }
+    size_t constants = 2 + pick(4);
+    auto constant = [&]() { return string("'") + char('a' + pick(constants)) + "'"; };
+    text += "Facts:\n";
+    for (size_t i = 0; i < max<size_t>(1, relations / 2); i++)
+        for (size_t f = 1 + pick(8); f > 0; f--) {
+            text += "  r" + to_string(i) + "(";
+            for (size_t c = 0; c < arity[i]; c++)
+                text += (c ? "," : "") + constant();
+            text += ").\n";
+        }
+    text += "Rules:\n";
+    for (size_t rules = 1 + pick(6); rules > 0; rules--) {
+        string body;
+        vector<string> variables;
+        for (size_t atoms = 1 + pick(3); atoms > 0; atoms--) {
+            size_t b = pick(relations);
+            body += (body.empty() ? "r" : ",r") + to_string(b) + "(";
+            for (size_t c = 0; c < arity[b]; c++) {
+                string param = constant();
+                if (pick(100) >= 15) {
+                    param = string(1, "xyzw"[pick(4)]);
+                    variables.push_back(param);
+                }
+                body += (c ? "," : "") + param;
+            }
+            body += ")";
+        }
+        if (variables.empty())
+            continue;
+        size_t h = pick(relations);
+        text += "  r" + to_string(h) + "(";
+        for (size_t c = 0; c < arity[h]; c++)
+            text += (c ? "," : "") + variables[pick(variables.size())];
+        text += ") :- " + body + ".\n";
+    }
+    text += "Queries:\n";
+    for (size_t queries = 1 + pick(4); queries > 0; queries--) {
+        size_t q = pick(relations);
+        text += "  r" + to_string(q) + "(";
+        for (size_t c = 0; c < arity[q]; c++)
+            text += (c ? "," : "") + (pick(100) < 30 ? constant() : string(1, "XYZ"[pick(3)]));
+        text += ")?\n";
+    }
+    return text;
+}
+
+// Evaluates random programs on one thread and on 'threads', with joins
+// partitioned as well, and checks that the output is the same. Built with
+// -fsanitize=thread, this is the check for data races in parallel passes.
+static void benchmarkThreaded(size_t programs, size_t threads) {
+    mt19937 random(programs);
+    size_t mismatches = 0;
+    auto start = chrono::steady_clock::now();
+    for (size_t p = 0; p < programs; p++) {
+        string text = randomProgram(random);
+        Scanner scanner(text);
+        scanner.scan();
+        Parser parser(scanner.getTokens());
+        parser.parse();
+        string outputs[2];
+        for (int parallel = 0; parallel < 2; parallel++) {
+            SymbolTable::global() = SymbolTable();
+            Interpreter interpreter(parser.datalogProgram);
+            if (parallel) {
+                interpreter.setThreadCount(threads);
+                interpreter.setParallelJoinThreshold(0);
+                interpreter.setBackgroundOutput(true);
+            }
+            outputs[parallel] = interpretOutput(interpreter);
+        }
+        if (outputs[0] != outputs[1]) {
+            if (mismatches++ == 0)
+                cerr << "First mismatch:\n" << text;
+        }
+    }
+    cout << "threaded programs=" << programs << " threads=" << threads << ": " << secondsSince(start) << "s";
+    if (mismatches > 0)
+        cout << " MISMATCH (" << mismatches << " programs)";
+    cout << "\n";
+}
+
+// Evaluates random programs with the default settings and with the flat
+// naive engine the interpreter started out with, and checks that the whole
+// output is the same; stratified evaluation has to give the same answers.
+static void benchmarkEngines(size_t programs) {
+    mt19937 random(programs);
+    size_t mismatches = 0, answerMismatches = 0;
+    auto start = chrono::steady_clock::now();
+    for (size_t p = 0; p < programs; p++) {
+        string text = randomProgram(random);
+        Scanner scanner(text);
+        scanner.scan();
+        Parser parser(scanner.getTokens());
+        parser.parse();
+        string outputs[3];
+        for (int engine = 0; engine < 3; engine++) {
+            SymbolTable::global() = SymbolTable();
+            Interpreter interpreter(parser.datalogProgram);
+            if (engine == 1) {
+                interpreter.setStratified(false);
+                interpreter.setSemiNaive(false);
+            } else if (engine == 2) {
+                interpreter.setStratified(true);
+            }
+            outputs[engine] = engine == 2 ? interpretAnswers(interpreter) : interpretOutput(interpreter);
+        }
+        if (outputs[0] != outputs[1] && mismatches++ == 0)
+            cerr << "First output mismatch:\n" << text;
+        if (outputs[0].substr(outputs[0].find("Query Evaluation")) != outputs[2] && answerMismatches++ == 0)
+            cerr << "First answer mismatch:\n" << text;
+    }
+    cout << "engines programs=" << programs << ": " << secondsSince(start) << "s";
+    if (mismatches > 0)
+        cout << " MISMATCH (" << mismatches << " programs)";
+    if (answerMismatches > 0)
+        cout << " STRATIFIED MISMATCH (" << answerMismatches << " programs)";
+    cout << "\n";
+}
+
+static Predicate makeFact(const string& name, const vector<string>& values) {
+    Predicate fact(name);
+    for (const string& value : values)
+        fact.addParameter(Parameter(value));
+    return fact;
+}
+
+// Random inserts and retractions of edges, labels and given paths on n
+// nodes in chains of 50 with short forward links between them. After
+// every batch of updates the maintained answers are checked against a
+// from-scratch evaluation of the same facts.
+static void benchmarkIncremental(size_t n, size_t updates) {
+    string text = "Schemes:\n  edge(A,B)\n  label(A,L)\n  path(A,B)\n  tagged(A,L)\n"
+                  "  cycle(A)\n  rooted(A)\nFacts:\n  label('n0','x').\nRules:\n"
+                  "  path(X,Y) :- edge(X,Y).\n  path(X,Z) :- path(X,Y),edge(Y,Z).\n"
+                  "  tagged(X,L) :- path(X,Y),label(Y,L).\n  cycle(X) :- path(X,X).\n"
+                  "  rooted(X) :- path('n0',X).\n"
+                  "Queries:\n  path(X,Y)?\n  tagged(X,L)?\n  cycle(X)?\n  rooted(X)?\n";
+    Scanner scanner(text);
+    scanner.scan();
+    Parser parser(scanner.getTokens());
+    parser.parse();
+    const DatalogProgram& rules = parser.datalogProgram;
+
+    mt19937 random(n);
+    auto node = [&](size_t i) { return quoted("n", i % n); };
+    auto randomFact = [&]() {
+        size_t i = random() % n;
+        switch (random() % 8) {
+        case 0:
+            return makeFact("label", {node(i), quoted("l", random() % 4)});
+        case 1:
+            return makeFact("path", {node(i), node(i + 1 + random() % 30)});
+        case 2:
+            return makeFact("edge", {node(i), node(i - random() % 3 + n)});
+        default:
+            return makeFact("edge", {node(i), node(i + 1 + random() % 10)});
+        }
+    };
+    set<string> present;
+    vector<Predicate> given;
+    auto give = [&](const Predicate& fact) {
+        if (present.insert(fact.toString()).second)
+            given.push_back(fact);
+    };
+    give(rules.facts[0]);
+    for (size_t i = 0; i + 1 < n; i++)
+        if ((i + 1) % 50 != 0)
+            give(makeFact("edge", {node(i), node(i + 1)}));
+    for (size_t i = 0; i < n / 10; i++)
+        give(randomFact());
+
+    DatalogProgram initial = rules;
+    initial.facts = given;
+    Interpreter incremental(initial);
+    interpretAnswers(incremental);
+
+    double updateSeconds = 0, recomputeSeconds = 0;
+    size_t checks = 0, mismatches = 0;
+    for (size_t u = 1; u <= updates; u++) {
+        bool retract = random() % 2 == 0 && !given.empty();
+        Predicate fact = retract ? given[random() % given.size()] : randomFact();
+        auto start = chrono::steady_clock::now();
+        if (retract)
+            incremental.retractFacts({fact});
+        else
+            incremental.insertFacts({fact});
+        updateSeconds += secondsSince(start);
+        if (retract) {
+            present.erase(fact.toString());
+            for (size_t i = 0; i < given.size(); i++)
+                if (given[i].toString() == fact.toString()) {
+                    given[i] = given.back();
+                    given.pop_back();
+                    break;
+                }
+        } else {
+            give(fact);
+        }
+
+        if (u % 20 != 0 && u != updates)
+            continue;
+        DatalogProgram current = rules;
+        current.facts.clear();
+        for (const Predicate& fact : given)
+            current.addFact(fact);
+        double seconds;
+        string expected = queryAnswers(current, false, seconds);
+        recomputeSeconds += seconds;
+        checks++;
+        if (interpretAnswers(incremental) != expected)
+            mismatches++;
+    }
+    cout << "incremental n=" << n << " updates=" << updates << " per update: "
+         << updateSeconds / updates << "s recompute: " << recomputeSeconds / checks
+         << "s speedup: " << (recomputeSeconds / checks) / (updateSeconds / updates) << "x";
+    if (mismatches)
+        cout << " MISMATCH (" << mismatches << " of " << checks << " checks)";
+    cout << "\n";
+}
+
+// Synthetic programs of the shapes the suite times. Each takes a size,
+// scaled by --scale, and is deterministic for a given size.
+struct Workload {
+    string name;
+    size_t size;
+    string text;
+};
+
+static string edgeFact(const string& relation, const string& from, const string& to) {
+    return "  " + relation + "('" + from + "','" + to + "').\n";
+}
+
+static Workload chainClosure(size_t n) {
+    string text = "Schemes:\n  edge(A,B)\n  path(A,B)\nFacts:\n";
+    for (size_t i = 0; i + 1 < n; i++)
+        text += edgeFact("edge", "n" + to_string(i), "n" + to_string(i + 1));
+    text += "Rules:\n  path(X,Y) :- edge(X,Y).\n  path(X,Z) :- edge(X,Y),path(Y,Z).\n"
+            "Queries:\n  path('n0',X)?\n  path(X,Y)?\n";
+    return {"chain-closure", n, text};
+}
+
+// n nodes and 2n random edges, so most nodes end up in one large cycle.
+static Workload randomClosure(size_t n) {
+    mt19937 random(n);
+    string text = "Schemes:\n  edge(A,B)\n  path(A,B)\nFacts:\n";
+    for (size_t i = 0; i < 2 * n; i++)
+        text += edgeFact("edge", "n" + to_string(random() % n), "n" + to_string(random() % n));
+    text += "Rules:\n  path(X,Y) :- edge(X,Y).\n  path(X,Z) :- path(X,Y),edge(Y,Z).\n"
+            "Queries:\n  path('n0',X)?\n  path(X,X)?\n";
+    return {"random-closure", n, text};
+}
+
+// Pairs of nodes at the same depth of a binary tree of n nodes.
+static Workload sameGeneration(size_t n) {
+    string text = "Schemes:\n  parent(C,P)\n  sg(A,B)\nFacts:\n";
+    for (size_t i = 1; i < n; i++)
+        text += edgeFact("parent", "n" + to_string(i), "n" + to_string((i - 1) / 2));
+    text += "Rules:\n  sg(X,Y) :- parent(X,P),parent(Y,P).\n"
+            "  sg(X,Y) :- parent(X,A),sg(A,B),parent(Y,B).\n"
+            "Queries:\n  sg('n" + to_string(n - 1) + "',X)?\n";
+    return {"same-generation", n, text};
+}
+
+// Reachability from one corner of an n by n grid.
+static Workload gridReachability(size_t n) {
+    auto cell = [](size_t x, size_t y) { return "c" + to_string(x) + "_" + to_string(y); };
+    string text = "Schemes:\n  edge(A,B)\n  start(A)\n  reach(A)\nFacts:\n  start('c0_0').\n";
+    for (size_t x = 0; x < n; x++)
+        for (size_t y = 0; y < n; y++) {
+            if (x + 1 < n)
+                text += edgeFact("edge", cell(x, y), cell(x + 1, y));
+            if (y + 1 < n)
+                text += edgeFact("edge", cell(x, y), cell(x, y + 1));
+        }
+    text += "Rules:\n  reach(X) :- start(X).\n  reach(Y) :- reach(X),edge(X,Y).\n"
+            "Queries:\n  reach('" + cell(n - 1, n - 1) + "')?\n  reach(X)?\n";
+    return {"grid-reachability", n, text};
+}
+
+// n facts of arity 12 and no rules: scanning, parsing and loading only.
+static Workload wideFacts(size_t n) {
+    const size_t arity = 12;
+    string text = "Schemes:\n  wide(";
+    for (size_t c = 0; c < arity; c++)
+        text += (c ? ",C" : "C") + to_string(c);
+    text += ")\nFacts:\n";
+    for (size_t i = 0; i < n; i++) {
+        text += "  wide(";
+        for (size_t c = 0; c < arity; c++)
+            text += (c ? "," : "") + quoted("v" + to_string(c) + "_", (i * (c + 1)) % (n / (c + 1) + 1));
+        text += ").\n";
+    }
+    text += "Rules:\nQueries:\n  wide(A,B,C,'v3_7',E,F,G,H,I,J,K,L)?\n";
+    return {"wide-facts", n, text};
+}
+
+// A 40-stage non-recursive pipeline over n base tuples, each stage joining
+// the previous one with one of five lookup tables.
+static Workload pipeline(size_t n) {
+    const size_t stages = 40;
+    string text = "Schemes:\n  base(A,B)\n";
+    for (size_t m = 0; m < 5; m++)
+        text += "  map" + to_string(m) + "(A,B)\n";
+    for (size_t k = 1; k <= stages; k++)
+        text += "  stage" + to_string(k) + "(A,B)\n";
+    text += "Facts:\n";
+    for (size_t i = 0; i < n; i++)
+        text += edgeFact("base", "a" + to_string(i), "k" + to_string(i));
+    for (size_t m = 0; m < 5; m++)
+        for (size_t i = 0; i < n; i++)
+            text += edgeFact("map" + to_string(m), "k" + to_string(i), "k" + to_string((i * (2 * m + 3) + m) % n));
+    text += "Rules:\n  stage1(A,B) :- base(A,B).\n";
+    for (size_t k = 2; k <= stages; k++)
+        text += "  stage" + to_string(k) + "(A,C) :- stage" + to_string(k - 1) + "(A,B),map" +
+                to_string(k % 5) + "(B,C).\n";
+    text += "Queries:\n  stage" + to_string(stages) + "('a0',X)?\n";
+    return {"pipeline", n, text};
+}
+
+// Peak resident set size in KB since the last resetPeakRss().
+static size_t peakRssKb() {
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line))
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return strtoull(line.c_str() + 6, nullptr, 10);
+    return 0;
+}
+
+static void resetPeakRss() {
+    ofstream clear("/proc/self/clear_refs");
+    clear << "5";
+}
+
+struct SuiteResult {
+    string name;
+    size_t size;
+    size_t facts;
+    size_t tuples;
+    vector<pair<string, double>> phases;    // seconds, in phase order
+    double megabytesPerSecond;
+    double factsPerSecond;
+    double tuplesPerSecond;
+    size_t peakRssKb;
+    Arena::Stats arena;
+};
+
+// With a 'profilePrefix', the interpreter is profiled and the profile
+// written to <prefix>-<workload>.json and .folded, which adds its own cost
+// to the times.
+static SuiteResult runWorkload(const Workload& workload, size_t threads, bool arenas, const string& profilePrefix) {
+    SymbolTable::global() = SymbolTable();
+    resetPeakRss();
+    SuiteResult result;
+    result.name = workload.name;
+    result.size = workload.size;
+
+    auto start = chrono::steady_clock::now();
+    Scanner scanner(workload.text);
+    scanner.scan();
+    result.phases.push_back({"scan", secondsSince(start)});
+    start = chrono::steady_clock::now();
+    Parser parser(scanner.getTokens());
+    parser.parse();
+    result.phases.push_back({"parse", secondsSince(start)});
+    result.facts = parser.datalogProgram.facts.size();
+
+    // Rule and query output is not part of the measurement.
+    streambuf* saved = cout.rdbuf(nullptr);
+    start = chrono::steady_clock::now();
+    Profiler profiler;
+    Interpreter interpreter(parser.datalogProgram);
+    interpreter.setThreadCount(threads);
+    interpreter.setArenaAllocation(arenas);
+    if (!profilePrefix.empty())
+        interpreter.setProfiler(&profiler);
+    interpreter.loadProgram();
+    result.phases.push_back({"load", secondsSince(start)});
+    start = chrono::steady_clock::now();
+    interpreter.compileRules();
+    interpreter.evaluateRules();
+    result.phases.push_back({"rules", secondsSince(start)});
+    start = chrono::steady_clock::now();
+    interpreter.evaluateQueries();
+    result.phases.push_back({"queries", secondsSince(start)});
+    cout.rdbuf(saved);
+
+    size_t stored = 0;
+    for (const auto& entry : interpreter.getDatabase().getRelations())
+        stored += entry.second.size();
+    result.tuples = stored - min(stored, result.facts);
+    double total = 0;
+    for (const auto& phase : result.phases)
+        total += phase.second;
+    result.phases.push_back({"total", total});
+    result.megabytesPerSecond = workload.text.size() / double(1 << 20) / max(result.phases[0].second, 1e-9);
+    result.factsPerSecond = result.facts / max(result.phases[2].second, 1e-9);
+    result.tuplesPerSecond = result.tuples / max(result.phases[3].second, 1e-9);
+    result.peakRssKb = peakRssKb();
+    result.arena = interpreter.arenaStats();
+    if (!profilePrefix.empty()) {
+        writeFile(profilePrefix + "-" + workload.name + ".json", profiler.toJson());
+        writeFile(profilePrefix + "-" + workload.name + ".folded", profiler.toFolded());
+    }
+    return result;
+}
+
+static string suiteJson(const vector<SuiteResult>& results, size_t threads) {
+    stringstream json;
+    json << "{\n  \"threads\": " << threads << ",\n  \"workloads\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const SuiteResult& r = results[i];
+        json << "    {\"name\": \"" << r.name << "\", \"size\": " << r.size << ", \"facts\": " << r.facts
+             << ", \"derived\": " << r.tuples;
+        for (const auto& phase : r.phases)
+            json << ", \"" << phase.first << "\": " << phase.second;
+        json << ", \"scanMBps\": " << r.megabytesPerSecond << ", \"factsPerSecond\": " << r.factsPerSecond
+             << ", \"tuplesPerSecond\": " << r.tuplesPerSecond << ", \"peakRssKb\": " << r.peakRssKb
+             << ", \"scratchAllocations\": " << r.arena.allocations << ", \"arenaHighWaterKb\": "
+             << r.arena.highWater / 1024 << ", \"arenaBlocks\": " << r.arena.blocks << "}"
+             << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    json << "  ]\n}\n";
+    return json.str();
+}
+
+// Reads back a number written by suiteJson() from one workload's line.
+static bool jsonNumber(const string& line, const string& key, double& value) {
+    size_t at = line.find("\"" + key + "\": ");
+    if (at == string::npos)
+        return false;
+    value = strtod(line.c_str() + at + key.size() + 4, nullptr);
+    return true;
+}
+
+// Baseline workload lines by name and size.
+static map<string, string> readBaseline(const string& path) {
+    map<string, string> lines;
+    ifstream in(path);
+    string line;
+    while (getline(in, line)) {
+        size_t at = line.find("\"name\": \"");
+        double size;
+        if (at == string::npos || !jsonNumber(line, "size", size))
+            continue;
+        at += 9;
+        lines[line.substr(at, line.find('"', at) - at) + "/" + to_string(size_t(size))] = line;
+    }
+    return lines;
+}
+
+static void printResult(const SuiteResult& r, const map<string, string>& baseline) {
+    cout << r.name << " n=" << r.size << " facts=" << r.facts << " derived=" << r.tuples << "\n ";
+    auto it = baseline.find(r.name + "/" + to_string(r.size));
+    for (const auto& phase : r.phases) {
+        cout << " " << phase.first << ": " << phase.second << "s";
+        double before;
+        if (it != baseline.end() && jsonNumber(it->second, phase.first, before) && before > 0)
+            cout << " (" << showpos << int((phase.second / before - 1) * 100) << noshowpos << "%)";
+    }
+    cout << "\n  scan: " << r.megabytesPerSecond << " MB/s load: " << size_t(r.factsPerSecond)
+         << " facts/s rules: " << size_t(r.tuplesPerSecond) << " tuples/s peak RSS: " << r.peakRssKb << " KB";
+    double before;
+    if (it != baseline.end() && jsonNumber(it->second, "peakRssKb", before) && before > 0)
+        cout << " (" << showpos << int((r.peakRssKb / before - 1) * 100) << noshowpos << "%)";
+    cout << "\n  scratch: " << r.arena.allocations << " allocations, high water " << r.arena.highWater / 1024
+         << " KB, " << r.arena.blocks << " arena blocks\n";
+}
+
+static void benchmarkSuite(size_t scale, size_t threads, bool arenas, const string& jsonPath,
+                           const string& baselinePath, const string& profilePrefix) {
+    vector<Workload> workloads = {
+        chainClosure(500 * scale),   randomClosure(200 * scale), sameGeneration(1000 * scale),
+        gridReachability(100 * scale), wideFacts(100000 * scale), pipeline(10000 * scale),
+    };
+    map<string, string> baseline;
+    if (!baselinePath.empty())
+        baseline = readBaseline(baselinePath);
+    vector<SuiteResult> results;
+    for (const Workload& workload : workloads) {
+        results.push_back(runWorkload(workload, threads, arenas, profilePrefix));
+        printResult(results.back(), baseline);
+    }
+    if (!jsonPath.empty()) {
+        writeFile(jsonPath, suiteJson(results, threads));
+        cout << "Results written to " << jsonPath << "\n";
+    }
+    if (!profilePrefix.empty())
+        cout << "Profiles written to " << profilePrefix << "-<workload>.json and .folded\n";
+}
+
+static int usage(const char* program) {
+    cerr << "usage: " << program << " join [--nested-limit N] [--threads N] [sizes...]\n"
+         << "       " << program << " parse [--vector-limit N] [--threads N] [sizes...]\n"
+         << "       " << program << " ingest [--vector-limit N] [sizes...]\n"
+         << "       " << program << " demand [sizes...]\n"
+         << "       " << program << " closure [sizes...]\n"
+         << "       " << program << " snapshot [sizes...]\n"
+         << "       " << program << " incremental [--updates N] [sizes...]\n"
+         << "       " << program << " output [sizes...]\n"
+         << "       " << program << " threaded [--threads N] [programs...]\n"
+         << "       " << program << " engines [programs...]\n"
+         << "       " << program << " suite [--scale N] [--threads N] [--no-arena] [--json PATH] [--baseline PATH]\n"
+         << "       " << program << "       [--profile PREFIX]"
+         << endl;
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2)
+        return usage(argv[0]);
+    string mode = argv[1];
+    if (mode != "join" && mode != "parse" && mode != "ingest" && mode != "demand" &&
+        mode != "closure" && mode != "snapshot" && mode != "incremental" && mode != "output" &&
+        mode != "threaded" && mode != "engines" && mode != "suite")
+        return usage(argv[0]);
+    size_t nestedLimit = 10000;
+    size_t vectorLimit = 1000000;
+    size_t threads = 1;
+    size_t updates = 200;
+    size_t scale = 1;
+    bool arenas = true;
+    string jsonPath, baselinePath, profilePrefix;
+    vector<size_t> sizes;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--nested-limit") == 0 && i + 1 < argc)
+            nestedLimit = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--vector-limit") == 0 && i + 1 < argc)
+            vectorLimit = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            threads = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--updates") == 0 && i + 1 < argc)
+            updates = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc)
+            scale = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--no-arena") == 0)
+            arenas = false;
+        else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+            jsonPath = argv[++i];
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+            baselinePath = argv[++i];
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+            profilePrefix = argv[++i];
+        else
+            sizes.push_back(strtoull(argv[i], nullptr, 10));
+    }
+    if (sizes.empty() && mode == "join")
+        sizes = {10000, 100000, 1000000};
+    else if (sizes.empty() && mode == "demand")
+        sizes = {2000, 10000, 20000};
+    else if (sizes.empty() && mode == "snapshot")
+        sizes = {2000, 10000, 20000};
+    else if (sizes.empty() && mode == "closure")
+        sizes = {1000, 2000, 4000};
+    else if (sizes.empty() && mode == "incremental")
+        sizes = {500, 2000, 5000};
+    else if (sizes.empty() && mode == "output")
+        sizes = {10000, 100000, 1000000};
+    else if (sizes.empty() && (mode == "threaded" || mode == "engines"))
+        sizes = {500};
+    else if (sizes.empty())
+        sizes = {1000, 10000, 100000, 1000000, 10000000};
+    if (mode == "suite") {
+        benchmarkSuite(max<size_t>(scale, 1), threads, arenas, jsonPath, baselinePath, profilePrefix);
+        return 0;
+    }
+    if (mode == "closure") {
+        benchmarkClosure(sizes);
+        return 0;
+    }
+    unique_ptr<ThreadPool> pool(threads > 1 ? new ThreadPool(threads) : nullptr);
+    for (size_t n : sizes) {
+        if (mode == "join")
+            benchmarkJoin(n, nestedLimit, pool.get());
+        else if (mode == "parse")
+            benchmarkParse(n, vectorLimit, pool.get());
+        else if (mode == "ingest")
+            benchmarkIngest(n, vectorLimit);
+        else if (mode == "demand")
+            benchmarkDemand(n);
+        else if (mode == "snapshot")
+            benchmarkSnapshot(n);
+        else if (mode == "output")
+            benchmarkOutput(n);
+        else if (mode == "threaded")
+            benchmarkThreaded(n, threads > 1 ? threads : 4);
+        else if (mode == "engines")
+            benchmarkEngines(n);
+        else
+            benchmarkIncremental(n, updates);
+    }
+    return 0;
+}
@@ -8,7 +8,19 @@
 #include <sstream>
 #include <fstream>
 #include <algorithm>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <memory_resource>
+#include <string_view>
 #include "parser.cpp"
+#include "arena.h"
+#include "output.h"
+#include "profiler.h"
+#include "threadpool.h"
 
 using namespace std;
 
@@ -25,6 +37,9 @@ public:
     void addEdge(int adjacentNodeID) {
         adjacentNodeIDs.insert(adjacentNodeID);
     }
+    const set<int>& getAdjacentNodeIDs() const {
+        return adjacentNodeIDs;
+    }
     string toString() const {
         stringstream ss;
         bool first = true;
@@ -49,12 +64,69 @@ public:
     void addEdge(int fromNodeID, int toNodeID) {
         nodes[fromNodeID].addEdge(toNodeID);
     }
+    bool hasEdge(int fromNodeID, int toNodeID) const {
+        auto it = nodes.find(fromNodeID);
+        return it != nodes.end() && it->second.getAdjacentNodeIDs().count(toNodeID) > 0;
+    }
+    Graph reverse() const {
+        Graph result(nodes.size());
+        for (const auto &pair : nodes)
+            for (int toNodeID : pair.second.getAdjacentNodeIDs())
+                result.addEdge(toNodeID, pair.first);
+        return result;
+    }
+    // Depth-first postorder of the whole graph, starting trees in node order.
+    vector<int> postorder() const {
+        set<int> visited;
+        vector<int> order;
+        for (const auto &pair : nodes)
+            if (!visited.count(pair.first))
+                depthFirst(pair.first, visited, order);
+        return order;
+    }
+    // Strongly connected components, each one listed after every component
+    // it has edges to, so that evaluating them in order respects dependencies.
+    vector<set<int>> findSCCs() const {
+        vector<int> order = reverse().postorder();
+        set<int> visited;
+        vector<set<int>> components;
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            if (visited.count(*it))
+                continue;
+            vector<int> tree;
+            depthFirst(*it, visited, tree);
+            components.push_back(set<int>(tree.begin(), tree.end()));
+        }
+        return components;
+    }
     string toString() const {
         ostringstream oss;
         for (const auto &pair : nodes)
             oss << "R" << pair.first << ":" << pair.second.toString() << "\n";
         return oss.str();
     }
+private:
+    void depthFirst(int startNodeID, set<int>& visited, vector<int>& order) const {
+        // Iterative so that long rule chains cannot exhaust the stack.
+        vector<pair<int, set<int>::const_iterator>> stack;
+        visited.insert(startNodeID);
+        stack.push_back({startNodeID, nodes.at(startNodeID).getAdjacentNodeIDs().begin()});
+        while (!stack.empty()) {
+            int nodeID = stack.back().first;
+            const set<int>& adjacent = nodes.at(nodeID).getAdjacentNodeIDs();
+            auto& next = stack.back().second;
+            if (next == adjacent.end()) {
+                order.push_back(nodeID);
+                stack.pop_back();
+                continue;
+            }
+            int adjacentNodeID = *next++;
+            if (!visited.count(adjacentNodeID)) {
+                visited.insert(adjacentNodeID);
+                stack.push_back({adjacentNodeID, nodes.at(adjacentNodeID).getAdjacentNodeIDs().begin()});
+            }
+        }
+    }
 };
 
 class Scheme : public vector<string> {
@@ -63,108 +135,866 @@ public:
     Scheme(const vector<string>& attributes) : vector<string>(attributes) {}
 };
 
-class Tuple : public vector<string> {
+typedef uint32_t Symbol;
+
+// Interns every constant so tuples can hold 32-bit IDs instead of strings.
+// IDs handed out in ascending string order keep ID order and string order
+// in step; once that stops holding, output sorts by the strings instead.
+class SymbolTable {
+private:
+    vector<string> names;
+    // Open addressing over IDs: the high half of a slot holds the value's
+    // 32-bit hash, the low half ID + 1, with 0 for an empty slot. Probes
+    // compare hashes before touching the string itself.
+    vector<uint64_t> slots;
+    bool ordered;
+    void grow(size_t count) {
+        size_t capacity = 16;
+        while (capacity < count * 2)
+            capacity *= 2;
+        vector<uint64_t> old(capacity, 0);
+        old.swap(slots);
+        for (uint64_t entry : old) {
+            if (entry == 0)
+                continue;
+            size_t slot = (entry >> 32) & (capacity - 1);
+            while (slots[slot] != 0)
+                slot = (slot + 1) & (capacity - 1);
+            slots[slot] = entry;
+        }
+    }
+    // Slot holding 'value', or the empty slot it belongs in.
+    size_t findSlot(string_view value, uint32_t hashValue) const {
+        size_t mask = slots.size() - 1;
+        size_t slot = hashValue & mask;
+        while (slots[slot] != 0 &&
+               ((slots[slot] >> 32) != hashValue || names[(slots[slot] & 0xffffffff) - 1] != value))
+            slot = (slot + 1) & mask;
+        return slot;
+    }
 public:
-    Tuple() : vector<string>() {}
-    Tuple(const vector<string>& values) : vector<string>(values) {}
-    bool operator<(const Tuple& other) const {
-        return static_cast<vector<string>>(*this) < static_cast<vector<string>>(other);
+    SymbolTable() : ordered(true) {}
+    static SymbolTable& global() {
+        static SymbolTable table;
+        return table;
     }
-    string toString(const Scheme& scheme) const {
-        stringstream ss;
+    static uint32_t hashName(string_view value) {
+        return hash<string_view>()(value);
+    }
+    Symbol intern(string_view value) {
+        return intern(value, hashName(value));
+    }
+    // For bulk loads: with the hashes worked out up front, the slot of a
+    // value further ahead can be prefetched while this one is interned.
+    Symbol intern(string_view value, uint32_t hashValue) {
+        if ((names.size() + 1) * 2 > slots.size())
+            grow(names.size() + 1);
+        size_t slot = findSlot(value, hashValue);
+        if (slots[slot] != 0)
+            return (slots[slot] & 0xffffffff) - 1;
+        if (!names.empty() && value < names.back())
+            ordered = false;
+        Symbol id = names.size();
+        names.emplace_back(value);
+        slots[slot] = (uint64_t(hashValue) << 32) | (id + 1);
+        return id;
+    }
+    // Interns a sorted batch, such as DatalogProgram::domain, in order.
+    void internAll(const set<string>& values) {
+        for (const string& value : values)
+            intern(value);
+    }
+    void prefetch(uint32_t hashValue) const {
+        if (!slots.empty())
+            __builtin_prefetch(&slots[hashValue & (slots.size() - 1)]);
+    }
+    void reserve(size_t count) {
+        if (count > names.capacity())
+            names.reserve(max(count, names.capacity() * 2));
+        if (count * 2 > slots.size())
+            grow(count);
+    }
+    bool lookup(string_view value, Symbol& id) const {
+        if (slots.empty())
+            return false;
+        size_t slot = findSlot(value, hashName(value));
+        if (slots[slot] == 0)
+            return false;
+        id = (slots[slot] & 0xffffffff) - 1;
+        return true;
+    }
+    const string& name(Symbol id) const {
+        return names[id];
+    }
+    bool isOrdered() const {
+        return ordered;
+    }
+    size_t size() const {
+        return names.size();
+    }
+};
+
+// Read-only view of one row, either a Tuple or a row inside a Relation.
+class TupleRef {
+private:
+    const Symbol* values;
+    size_t count;
+public:
+    TupleRef(const Symbol* values, size_t count) : values(values), count(count) {}
+    size_t size() const {
+        return count;
+    }
+    Symbol operator[](size_t index) const {
+        return values[index];
+    }
+    const Symbol* begin() const {
+        return values;
+    }
+    const Symbol* end() const {
+        return values + count;
+    }
+    // Orders by the strings behind the IDs, which is the output order.
+    bool lessByName(const TupleRef& other) const {
+        const SymbolTable& symbols = SymbolTable::global();
+        if (symbols.isOrdered())
+            return lexicographical_compare(begin(), end(), other.begin(), other.end());
+        return lexicographical_compare(begin(), end(), other.begin(), other.end(),
+            [&symbols](Symbol a, Symbol b) { return symbols.name(a) < symbols.name(b); });
+    }
+    // Appends "A='a', B='b'" to 'out', a string or an OutputBuffer,
+    // without building any strings of its own.
+    template<typename Out>
+    void appendTo(Out& out, const Scheme& scheme) const {
         for (size_t i = 0; i < scheme.size(); i++) {
             if (i > 0)
-                ss << ", ";
-            string value = at(i);
-            if (!value.empty() && value.front() == '\'' && value.back() == '\'')
-                value = value.substr(1, value.size()-2);
-            ss << scheme[i] << "='" << value << "'";
+                out.append(", ", 2);
+            out.append(scheme[i].data(), scheme[i].size());
+            out.append("='", 2);
+            appendUnquoted(out, SymbolTable::global().name(values[i]));
+            out.push_back('\'');
         }
-        return ss.str();
+    }
+    // Appends the values separated by tabs, with tab, newline, carriage
+    // return and backslash inside them escaped as \t, \n, \r and \\.
+    template<typename Out>
+    void appendTsv(Out& out) const {
+        for (size_t i = 0; i < count; i++) {
+            if (i > 0)
+                out.push_back('\t');
+            const string& value = SymbolTable::global().name(values[i]);
+            bool quoted = value.size() >= 2 && value.front() == '\'' && value.back() == '\'';
+            const char* text = value.data() + quoted;
+            const char* end = value.data() + value.size() - quoted;
+            for (const char* c = text; c < end; c++) {
+                const char* escape = tsvEscape(*c);
+                if (!escape)
+                    continue;
+                out.append(text, c - text);
+                out.append(escape, 2);
+                text = c + 1;
+            }
+            out.append(text, end - text);
+        }
+    }
+    string toString(const Scheme& scheme) const {
+        string text;
+        appendTo(text, scheme);
+        return text;
+    }
+private:
+    template<typename Out>
+    static void appendUnquoted(Out& out, const string& value) {
+        if (value.size() >= 2 && value.front() == '\'' && value.back() == '\'')
+            out.append(value.data() + 1, value.size() - 2);
+        else
+            out.append(value.data(), value.size());
+    }
+    static const char* tsvEscape(char c) {
+        switch (c) {
+            case '\t': return "\\t";
+            case '\n': return "\\n";
+            case '\r': return "\\r";
+            case '\\': return "\\\\";
+            default: return nullptr;
+        }
+    }
+};
+
+class Tuple : public vector<Symbol> {
+public:
+    Tuple() : vector<Symbol>() {}
+    Tuple(const vector<Symbol>& values) : vector<Symbol>(values) {}
+    Tuple(const vector<string>& values) {
+        reserve(values.size());
+        for (const string& value : values)
+            push_back(SymbolTable::global().intern(value));
+    }
+    Tuple(const TupleRef& row) : vector<Symbol>(row.begin(), row.end()) {}
+    operator TupleRef() const {
+        return TupleRef(data(), size());
+    }
+    bool operator<(const Tuple& other) const {
+        return static_cast<const vector<Symbol>&>(*this) < static_cast<const vector<Symbol>&>(other);
+    }
+    string toString(const Scheme& scheme) const {
+        return TupleRef(data(), size()).toString(scheme);
     }
 };
 
+// Secondary hash index over some columns of a Relation. Chains run through
+// row numbers: heads[bucket] and next[row] hold row + 1, with 0 ending a chain.
+struct RelationIndex {
+    vector<int> columns;
+    vector<uint32_t> heads;
+    vector<uint32_t> next;
+    size_t memoryUsage() const {
+        return sizeof(RelationIndex) + columns.capacity() * sizeof(int) +
+               (heads.capacity() + next.capacity()) * sizeof(uint32_t);
+    }
+};
+
+// How the columns of two relations line up in a join, worked out once.
+struct JoinColumns {
+    vector<int> leftKeys;       // join columns on the left...
+    vector<int> rightKeys;      // ...and the matching ones on the right
+    vector<int> rightExtras;    // right columns appended to the left row
+    Scheme scheme;              // scheme of the joined relation
+};
+
+// Rows are stored back to back in one fixed-arity buffer, in insertion
+// order, with an open-addressing table of row numbers for uniqueness.
+// While rows are only appended, "the rows past a mark" is exactly what was
+// added since the relation had that size; removeRow() breaks that.
+// Operators allocate their results from the scratch resource, which is
+// the heap unless a ScratchScope is active; copies always go to the heap,
+// so a relation that outlives a scope must be copied out of it.
 class Relation {
 private:
     string name;
     Scheme scheme;
-    set<Tuple> tuples;
+    size_t arity;
+    size_t rowCount;
+    pmr::vector<Symbol> rows;
+    // Row number + 1, or 0 for an empty slot. Join results are appended
+    // without it, since their rows are distinct by construction, and it is
+    // rebuilt on the first lookup after that.
+    mutable pmr::vector<uint32_t> slots;
+    mutable bool slotsStale;
+    // Built on first use by a selection or join and then kept up to date
+    // as rows are added, hence mutable. A deque, so that building one while
+    // another is being probed leaves the first in place.
+    mutable deque<RelationIndex> indexes;
+    struct DistinctCount {
+        bool counted = false;
+        size_t rows = 0;            // row count when counted
+        size_t values = 0;
+    };
+    mutable vector<DistinctCount> distinctCounts;
+    static size_t hashRow(const Symbol* row, size_t count) {
+        uint64_t seed = 0x9e3779b97f4a7c15ULL;
+        for (size_t i = 0; i < count; i++) {
+            seed ^= row[i];
+            seed *= 0xff51afd7ed558ccdULL;
+            seed ^= seed >> 32;
+        }
+        return seed;
+    }
+    static size_t hashColumns(const Symbol* row, const vector<int>& columns) {
+        uint64_t seed = 0x9e3779b97f4a7c15ULL;
+        for (int column : columns) {
+            seed ^= row[column];
+            seed *= 0xff51afd7ed558ccdULL;
+            seed ^= seed >> 32;
+        }
+        return seed;
+    }
+    void rebuildSlots(size_t minimumRows) const {
+        size_t capacity = 16;
+        while (capacity < minimumRows * 2)
+            capacity *= 2;
+        slots.assign(capacity, 0);
+        slotsStale = false;
+        for (size_t r = 0; r < rowCount; r++) {
+            size_t slot = hashRow(row(r), arity) & (capacity - 1);
+            while (slots[slot] != 0)
+                slot = (slot + 1) & (capacity - 1);
+            slots[slot] = r + 1;
+        }
+    }
+    void buildIndex(RelationIndex& index) const {
+        size_t buckets = 16;
+        while (buckets < rowCount * 2)
+            buckets *= 2;
+        index.heads.assign(buckets, 0);
+        index.next.assign(rowCount, 0);
+        for (size_t r = 0; r < rowCount; r++) {
+            size_t bucket = hashColumns(row(r), index.columns) & (buckets - 1);
+            index.next[r] = index.heads[bucket];
+            index.heads[bucket] = r + 1;
+        }
+    }
+    void indexNewRow(RelationIndex& index) const {
+        size_t r = rowCount - 1;
+        if (rowCount * 2 > index.heads.size()) {
+            buildIndex(index);
+            return;
+        }
+        size_t bucket = hashColumns(row(r), index.columns) & (index.heads.size() - 1);
+        index.next.push_back(index.heads[bucket]);
+        index.heads[bucket] = r + 1;
+    }
+    void linkRow(RelationIndex& index, size_t r) const {
+        size_t bucket = hashColumns(row(r), index.columns) & (index.heads.size() - 1);
+        index.next[r] = index.heads[bucket];
+        index.heads[bucket] = r + 1;
+    }
+    void unlinkRow(RelationIndex& index, size_t r) const {
+        size_t bucket = hashColumns(row(r), index.columns) & (index.heads.size() - 1);
+        uint32_t* link = &index.heads[bucket];
+        while (*link != r + 1)
+            link = &index.next[*link - 1];
+        *link = index.next[r];
+    }
+    // Empties a uniqueness slot, shifting later entries of its probe run
+    // back so that every lookup still finds them.
+    void eraseSlot(size_t slot) {
+        size_t mask = slots.size() - 1;
+        size_t hole = slot;
+        for (size_t next = (hole + 1) & mask; slots[next] != 0; next = (next + 1) & mask) {
+            size_t home = hashRow(row(slots[next] - 1), arity) & mask;
+            if (((next - home) & mask) >= ((next - hole) & mask)) {
+                slots[hole] = slots[next];
+                hole = next;
+            }
+        }
+        slots[hole] = 0;
+    }
+    // Calls f(row number) for every row whose 'columns' equal 'key'.
+    template <typename F>
+    void forEachMatch(const RelationIndex& index, const Symbol* key, F f) const {
+        size_t bucket = hashRow(key, index.columns.size()) & (index.heads.size() - 1);
+        for (uint32_t r = index.heads[bucket]; r != 0; r = index.next[r - 1]) {
+            const Symbol* candidate = row(r - 1);
+            bool matches = true;
+            for (size_t i = 0; i < index.columns.size() && matches; i++)
+                matches = candidate[index.columns[i]] == key[i];
+            if (matches)
+                f(r - 1);
+        }
+    }
+    const RelationIndex* findIndex(const vector<int>& columns) const {
+        for (const RelationIndex& index : indexes)
+            if (index.columns == columns)
+                return &index;
+        return nullptr;
+    }
+    // Slot holding the row equal to 'values', or the empty slot it belongs in.
+    size_t findSlot(const Symbol* values) const {
+        size_t mask = slots.size() - 1;
+        size_t slot = hashRow(values, arity) & mask;
+        while (slots[slot] != 0 && !equal(values, values + arity, row(slots[slot] - 1)))
+            slot = (slot + 1) & mask;
+        return slot;
+    }
 public:
-    Relation() : name(""), scheme() {}
-    Relation(string name, Scheme scheme) : name(name), scheme(scheme) {}
-    void addTuple(const Tuple& tuple) {
-        tuples.insert(tuple);
+    class TupleRange {
+    private:
+        const Relation* relation;
+    public:
+        class iterator {
+        private:
+            const Relation* relation;
+            size_t index;
+        public:
+            iterator(const Relation* relation, size_t index) : relation(relation), index(index) {}
+            TupleRef operator*() const {
+                return TupleRef(relation->row(index), relation->arity);
+            }
+            iterator& operator++() {
+                ++index;
+                return *this;
+            }
+            bool operator!=(const iterator& other) const {
+                return index != other.index;
+            }
+        };
+        TupleRange(const Relation* relation) : relation(relation) {}
+        iterator begin() const {
+            return iterator(relation, 0);
+        }
+        iterator end() const {
+            return iterator(relation, relation->rowCount);
+        }
+        size_t size() const {
+            return relation->rowCount;
+        }
+    };
+
+    Relation() : name(""), scheme(), arity(0), rowCount(0), slotsStale(false) {}
+    Relation(string name, Scheme scheme, pmr::memory_resource* resource = pmr::get_default_resource())
+        : name(name), scheme(scheme), arity(scheme.size()), rowCount(0), rows(resource), slots(resource),
+          slotsStale(false) {}
+    Relation(const Relation& other) = default;
+    // A copy whose rows live in 'resource'.
+    Relation(const Relation& other, pmr::memory_resource* resource)
+        : name(other.name), scheme(other.scheme), arity(other.arity), rowCount(other.rowCount),
+          rows(other.rows, resource), slots(other.slots, resource), slotsStale(other.slotsStale),
+          indexes(other.indexes), distinctCounts(other.distinctCounts) {}
+    Relation(Relation&& other) = default;
+    Relation& operator=(const Relation& other) = default;
+    Relation& operator=(Relation&& other) = default;
+    // Where operators on this thread allocate their results.
+    static pmr::memory_resource*& scratchResource() {
+        thread_local pmr::memory_resource* resource = pmr::get_default_resource();
+        return resource;
+    }
+    // Sends this thread's operator results to 'resource' until destroyed.
+    class ScratchScope {
+    private:
+        pmr::memory_resource* previous;
+    public:
+        ScratchScope(pmr::memory_resource* resource) : previous(scratchResource()) {
+            scratchResource() = resource;
+        }
+        ~ScratchScope() {
+            scratchResource() = previous;
+        }
+        ScratchScope(const ScratchScope&) = delete;
+        ScratchScope& operator=(const ScratchScope&) = delete;
+    };
+    // Intra-operator parallelism for joins with at least 'threshold' rows
+    // on both sides combined; a null pool turns it off.
+    static void setParallelJoin(ThreadPool* pool, size_t threshold) {
+        parallelJoinPool() = pool;
+        parallelJoinThreshold() = threshold;
+    }
+    static ThreadPool*& parallelJoinPool() {
+        static ThreadPool* pool = nullptr;
+        return pool;
+    }
+    static size_t& parallelJoinThreshold() {
+        static size_t threshold = 100000;
+        return threshold;
+    }
+    const Symbol* row(size_t index) const {
+        return rows.data() + index * arity;
+    }
+    TupleRef tuple(size_t index) const {
+        return TupleRef(row(index), arity);
+    }
+    bool addRow(const Symbol* values) {
+        if (slotsStale || (rowCount + 1) * 2 > slots.size())
+            rebuildSlots(rowCount + 1);
+        size_t slot = findSlot(values);
+        if (slots[slot] != 0)
+            return false;
+        rows.insert(rows.end(), values, values + arity);
+        slots[slot] = ++rowCount;
+        for (RelationIndex& index : indexes)
+            indexNewRow(index);
+        return true;
+    }
+    // Appends a row known not to be present yet, without the uniqueness check.
+    void appendDistinctRow(const Symbol* values) {
+        rows.insert(rows.end(), values, values + arity);
+        ++rowCount;
+        slotsStale = true;
+        for (RelationIndex& index : indexes)
+            indexNewRow(index);
+    }
+    // Appends 'count' rows known to be distinct and not present yet, such
+    // as a relation's rows read back from a snapshot.
+    void appendDistinctRows(const Symbol* values, size_t count) {
+        rows.insert(rows.end(), values, values + count * arity);
+        rowCount += count;
+        slotsStale = true;
+        for (RelationIndex& index : indexes)
+            buildIndex(index);
+    }
+    // Removes the row equal to 'values' by moving the last row into its
+    // place. Row numbers change, so marks taken before no longer separate
+    // old rows from new ones.
+    bool removeRow(const Symbol* values) {
+        if (rowCount == 0)
+            return false;
+        if (slotsStale || slots.empty())
+            rebuildSlots(rowCount);
+        size_t slot = findSlot(values);
+        if (slots[slot] == 0)
+            return false;
+        size_t removed = slots[slot] - 1;
+        size_t last = rowCount - 1;
+        eraseSlot(slot);
+        for (RelationIndex& index : indexes)
+            unlinkRow(index, removed);
+        if (removed != last) {
+            for (RelationIndex& index : indexes)
+                unlinkRow(index, last);
+            slots[findSlot(row(last))] = removed + 1;
+            copy(row(last), row(last) + arity, rows.begin() + removed * arity);
+        }
+        rows.resize(last * arity);
+        rowCount = last;
+        for (RelationIndex& index : indexes) {
+            index.next.resize(rowCount);
+            if (removed != last)
+                linkRow(index, removed);
+        }
+        return true;
+    }
+    bool removeTuple(const TupleRef& tuple) {
+        return tuple.size() == arity && removeRow(tuple.begin());
+    }
+    // Calls f(row) for every row whose 'columns' equal 'key', through the
+    // index on those columns, until f returns false. Returns false if it
+    // stopped early.
+    template <typename F>
+    bool forEachMatching(const vector<int>& columns, const Symbol* key, F f) const {
+        if (columns.empty()) {
+            for (size_t r = 0; r < rowCount; r++)
+                if (!f(row(r)))
+                    return false;
+            return true;
+        }
+        const RelationIndex& index = indexOn(columns);
+        size_t bucket = hashRow(key, columns.size()) & (index.heads.size() - 1);
+        for (uint32_t r = index.heads[bucket]; r != 0; r = index.next[r - 1]) {
+            const Symbol* candidate = row(r - 1);
+            bool matches = true;
+            for (size_t i = 0; i < columns.size() && matches; i++)
+                matches = candidate[columns[i]] == key[i];
+            if (matches && !f(candidate))
+                return false;
+        }
+        return true;
+    }
+    // Adds 'count' rows, growing the row buffer and uniqueness table once
+    // for all of them.
+    // Returns how many were new.
+    size_t addRows(const Symbol* values, size_t count) {
+        if ((rowCount + count) * arity > rows.capacity())
+            reserve(max(rowCount + count, rowCount * 2));
+        size_t added = 0;
+        for (size_t r = 0; r < count; r++)
+            added += addRow(values + r * arity);
+        return added;
+    }
+    bool addTuple(const TupleRef& tuple) {
+        if (tuple.size() != arity) {
+            cerr << "Tuple arity " << tuple.size() << " does not match scheme of " << name << endl;
+            return false;
+        }
+        return addRow(tuple.begin());
+    }
+    bool addTuple(const Tuple& tuple) {
+        return addTuple(TupleRef(tuple));
+    }
+    bool contains(const TupleRef& tuple) const {
+        if (tuple.size() != arity || rowCount == 0)
+            return false;
+        if (slotsStale || slots.empty())
+            rebuildSlots(rowCount);
+        return slots[findSlot(tuple.begin())] != 0;
+    }
+    void reserve(size_t count) {
+        rows.reserve(count * arity);
+        if (slotsStale || count * 2 > slots.size())
+            rebuildSlots(max(count, rowCount));
     }
     Relation select(int index, const string& value) const {
-        Relation result(name, scheme);
-        for (const Tuple& tuple : tuples)
-            if (index >= 0 && index < static_cast<int>(tuple.size()) && tuple[index] == value)
-                result.addTuple(tuple);
+        Symbol id;
+        if (!SymbolTable::global().lookup(value, id))
+            return Relation(name, scheme, scratchResource());
+        return selectSymbol(index, id);
+    }
+    Relation selectSymbol(int index, Symbol value) const {
+        return selectConstants(vector<int>(1, index), vector<Symbol>(1, value));
+    }
+    // Rows whose 'columns' hold 'values', answered from a composite index
+    // on those columns that is built the first time it is asked for.
+    Relation selectConstants(const vector<int>& columns, const vector<Symbol>& values) const {
+        Relation result(name, scheme, scratchResource());
+        for (int column : columns)
+            if (column < 0 || column >= static_cast<int>(arity))
+                return result;
+        if (columns.empty()) {
+            result.unionWith(*this);
+            return result;
+        }
+        forEachMatch(indexOn(columns), values.data(),
+                     [&](size_t r) { result.addRow(row(r)); });
         return result;
     }
+    // Whether selecting on 'columns' can run without building an index,
+    // which is the one thing a selection changes in the relation.
+    bool hasIndexOn(const vector<int>& columns) const {
+        return columns.empty() || findIndex(columns) != nullptr;
+    }
+    const RelationIndex& indexOn(const vector<int>& columns) const {
+        const RelationIndex* existing = findIndex(columns);
+        if (existing)
+            return *existing;
+        indexes.push_back(RelationIndex());
+        indexes.back().columns = columns;
+        buildIndex(indexes.back());
+        return indexes.back();
+    }
+    // Distinct values in a column, recounted once the relation has doubled
+    // or halved since the last count. A count that is still current is only
+    // read, so parallel rule evaluation can share it once it is made.
+    size_t distinctCount(int column) const {
+        if (column < 0 || column >= static_cast<int>(arity))
+            return 0;
+        if (distinctCounts.size() != arity)
+            distinctCounts.assign(arity, DistinctCount());
+        DistinctCount& cached = distinctCounts[column];
+        if (!cached.counted || rowCount > 2 * cached.rows || 2 * rowCount < cached.rows) {
+            unordered_set<Symbol> values;
+            for (size_t r = 0; r < rowCount; r++)
+                values.insert(row(r)[column]);
+            cached.counted = true;
+            cached.rows = rowCount;
+            cached.values = values.size();
+        }
+        return cached.values;
+    }
+    size_t indexCount() const {
+        return indexes.size();
+    }
+    size_t indexMemoryUsage() const {
+        size_t total = 0;
+        for (const RelationIndex& index : indexes)
+            total += index.memoryUsage();
+        return total;
+    }
+    size_t rowMemoryUsage() const {
+        return rows.capacity() * sizeof(Symbol) + slots.capacity() * sizeof(uint32_t);
+    }
     Relation select(int index1, int index2) const {
-        Relation result(name, scheme);
-        for (const Tuple& tuple : tuples)
-            if (index1 >= 0 && index1 < static_cast<int>(tuple.size()) &&
-                index2 >= 0 && index2 < static_cast<int>(tuple.size()) &&
-                tuple[index1] == tuple[index2])
-                result.addTuple(tuple);
+        Relation result(name, scheme, scratchResource());
+        if (index1 < 0 || index1 >= static_cast<int>(arity) ||
+            index2 < 0 || index2 >= static_cast<int>(arity))
+            return result;
+        for (size_t r = 0; r < rowCount; r++)
+            if (row(r)[index1] == row(r)[index2])
+                result.addRow(row(r));
         return result;
     }
     Relation project(const vector<int>& indices) const {
         Scheme newScheme;
+        vector<int> columns;
         for (int index : indices) {
-            if (index >= 0 && index < static_cast<int>(scheme.size()))
+            if (index >= 0 && index < static_cast<int>(scheme.size())) {
                 newScheme.push_back(scheme[index]);
-            else
+                columns.push_back(index);
+            } else
                 cerr << "Index out of bounds in project(): " << index << endl;
         }
-        Relation result(name, newScheme);
-        for (const Tuple& tuple : tuples) {
-            Tuple newTuple;
-            for (int index : indices) {
-                if (index >= 0 && index < static_cast<int>(tuple.size()))
-                    newTuple.push_back(tuple[index]);
-                else
-                    cerr << "Index out of bounds in project tuple: " << index << endl;
-            }
-            result.addTuple(newTuple);
+        return project(columns, newScheme);
+    }
+    // Projection and rename in one step; 'columns' must be in range and
+    // line up with 'newScheme'.
+    Relation project(const vector<int>& columns, const Scheme& newScheme) const {
+        Relation result(name, newScheme, scratchResource());
+        vector<Symbol> newRow(columns.size());
+        for (size_t r = 0; r < rowCount; r++) {
+            for (size_t i = 0; i < columns.size(); i++)
+                newRow[i] = row(r)[columns[i]];
+            result.addRow(newRow.data());
         }
         return result;
     }
     Relation rename(const vector<string>& newAttributes) const {
-        Scheme newScheme(newAttributes);
-        Relation result(name, newScheme);
-        for (const Tuple& tuple : tuples)
-            result.addTuple(tuple);
+        if (newAttributes.size() != arity) {
+            cerr << "Rename to " << newAttributes.size() << " attributes on arity " << arity << endl;
+            return *this;
+        }
+        Relation result(name, Scheme(newAttributes), scratchResource());
+        result.rowCount = rowCount;
+        result.rows = rows;
+        result.slots = slots;
+        result.slotsStale = slotsStale;
         return result;
     }
+    // Column mapping for joining a relation with 'left' to one with 'right'.
+    static JoinColumns joinColumns(const Scheme& left, const Scheme& right) {
+        JoinColumns columns;
+        columns.scheme = left;
+        for (size_t i = 0; i < right.size(); i++) {
+            auto it = find(left.begin(), left.end(), right[i]);
+            if (it != left.end()) {
+                columns.leftKeys.push_back(distance(left.begin(), it));
+                columns.rightKeys.push_back(i);
+            } else {
+                columns.rightExtras.push_back(i);
+                columns.scheme.push_back(right[i]);
+            }
+        }
+        return columns;
+    }
     Relation join(const Relation& other) const {
+        return joinOn(other, joinColumns(scheme, other.scheme));
+    }
+    // Hash join on a precomputed column mapping: the smaller input is hashed
+    // on the join columns and the larger one probes it. Without shared
+    // columns this degenerates to a cross product.
+    // Every right column is either a join column or an extra, so distinct
+    // inputs always give distinct output rows and no uniqueness check is
+    // needed while emitting them.
+    Relation joinOn(const Relation& other, const JoinColumns& columns) const {
+        const vector<int>& leftKeys = columns.leftKeys;
+        const vector<int>& rightKeys = columns.rightKeys;
+        const vector<int>& rightExtras = columns.rightExtras;
+        ThreadPool* pool = parallelJoinPool();
+        if (pool && pool->size() > 1 && !leftKeys.empty() && !ThreadPool::inTask() &&
+            rowCount + other.rowCount >= parallelJoinThreshold())
+            return partitionedJoin(other, columns, *pool);
+        Relation result(name, columns.scheme, scratchResource());
+        vector<Symbol> newRow(result.arity);
+        auto emit = [&](const Symbol* left, const Symbol* right) {
+            copy(left, left + arity, newRow.begin());
+            for (size_t i = 0; i < rightExtras.size(); i++)
+                newRow[arity + i] = right[rightExtras[i]];
+            result.appendDistinctRow(newRow.data());
+        };
+        if (leftKeys.empty()) {
+            for (size_t r1 = 0; r1 < rowCount; r1++)
+                for (size_t r2 = 0; r2 < other.rowCount; r2++)
+                    emit(row(r1), other.row(r2));
+            return result;
+        }
+        // Probe an index one side already keeps on the join columns, or
+        // else hash the smaller side for the duration of this join.
+        const RelationIndex* leftIndex = findIndex(leftKeys);
+        const RelationIndex* rightIndex = other.findIndex(rightKeys);
+        bool buildLeft = leftIndex && !rightIndex ? true :
+                         rightIndex && !leftIndex ? false :
+                         rowCount <= other.rowCount;
+        const Relation& build = buildLeft ? *this : other;
+        const Relation& probe = buildLeft ? other : *this;
+        const vector<int>& probeKeys = buildLeft ? rightKeys : leftKeys;
+        RelationIndex temporary;
+        const RelationIndex* index = buildLeft ? leftIndex : rightIndex;
+        if (!index) {
+            temporary.columns = buildLeft ? leftKeys : rightKeys;
+            build.buildIndex(temporary);
+            index = &temporary;
+        }
+        vector<Symbol> key(probeKeys.size());
+        for (size_t p = 0; p < probe.rowCount; p++) {
+            const Symbol* probeRow = probe.row(p);
+            for (size_t i = 0; i < probeKeys.size(); i++)
+                key[i] = probeRow[probeKeys[i]];
+            build.forEachMatch(*index, key.data(), [&](size_t b) {
+                if (buildLeft)
+                    emit(build.row(b), probeRow);
+                else
+                    emit(probeRow, build.row(b));
+            });
+        }
+        return result;
+    }
+    // Parallel hash join: both inputs are split into partitions on the high
+    // bits of the join key hash, then each partition is built and probed on
+    // its own worker into its own buffer. The buffers are copied into
+    // disjoint ranges of the result, so no step needs a shared lock.
+    Relation partitionedJoin(const Relation& other, const JoinColumns& columns, ThreadPool& pool) const {
+        const vector<int>& rightExtras = columns.rightExtras;
+        bool buildLeft = rowCount <= other.rowCount;
+        const Relation& build = buildLeft ? *this : other;
+        const Relation& probe = buildLeft ? other : *this;
+        const vector<int>& buildKeys = buildLeft ? columns.leftKeys : columns.rightKeys;
+        const vector<int>& probeKeys = buildLeft ? columns.rightKeys : columns.leftKeys;
+        size_t workers = pool.size();
+        size_t partitions = 1;
+        while (partitions < workers * 4)
+            partitions *= 2;
+        auto partitionOf = [partitions](size_t hash) { return (hash >> 40) & (partitions - 1); };
+        // parts[w][p]: row numbers of worker w's chunk that fall in partition p.
+        auto split = [&](const Relation& input, const vector<int>& keys) {
+            vector<vector<vector<uint32_t>>> parts(workers, vector<vector<uint32_t>>(partitions));
+            size_t chunk = (input.rowCount + workers - 1) / workers;
+            pool.parallelFor(workers, [&](size_t w) {
+                size_t end = min(input.rowCount, (w + 1) * chunk);
+                for (size_t r = w * chunk; r < end; r++)
+                    parts[w][partitionOf(hashColumns(input.row(r), keys))].push_back(r);
+            });
+            return parts;
+        };
+        vector<vector<vector<uint32_t>>> buildParts = split(build, buildKeys);
+        vector<vector<vector<uint32_t>>> probeParts = split(probe, probeKeys);
+        size_t outputArity = columns.scheme.size();
+        vector<vector<Symbol>> outputs(partitions);
+        pool.parallelFor(partitions, [&](size_t p) {
+            vector<uint32_t> buildRows;
+            for (size_t w = 0; w < workers; w++)
+                buildRows.insert(buildRows.end(), buildParts[w][p].begin(), buildParts[w][p].end());
+            if (buildRows.empty())
+                return;
+            size_t buckets = 16;
+            while (buckets < buildRows.size() * 2)
+                buckets *= 2;
+            vector<uint32_t> heads(buckets, 0);
+            vector<uint32_t> next(buildRows.size(), 0);
+            for (size_t i = 0; i < buildRows.size(); i++) {
+                size_t bucket = hashColumns(build.row(buildRows[i]), buildKeys) & (buckets - 1);
+                next[i] = heads[bucket];
+                heads[bucket] = i + 1;
+            }
+            vector<Symbol>& output = outputs[p];
+            for (size_t w = 0; w < workers; w++) {
+                for (uint32_t probeRowNumber : probeParts[w][p]) {
+                    const Symbol* probeRow = probe.row(probeRowNumber);
+                    size_t bucket = hashColumns(probeRow, probeKeys) & (buckets - 1);
+                    for (uint32_t b = heads[bucket]; b != 0; b = next[b - 1]) {
+                        const Symbol* buildRow = build.row(buildRows[b - 1]);
+                        bool matches = true;
+                        for (size_t k = 0; k < buildKeys.size() && matches; k++)
+                            matches = buildRow[buildKeys[k]] == probeRow[probeKeys[k]];
+                        if (!matches)
+                            continue;
+                        const Symbol* left = buildLeft ? buildRow : probeRow;
+                        const Symbol* right = buildLeft ? probeRow : buildRow;
+                        output.insert(output.end(), left, left + arity);
+                        for (int column : rightExtras)
+                            output.push_back(right[column]);
+                    }
+                }
+            }
+        });
+        Relation result(name, columns.scheme, scratchResource());
+        vector<size_t> offsets(partitions + 1, 0);
+        for (size_t p = 0; p < partitions; p++)
+            offsets[p + 1] = offsets[p] + outputs[p].size();
+        result.rows.resize(offsets[partitions]);
+        result.rowCount = outputArity == 0 ? 0 : offsets[partitions] / outputArity;
+        result.slotsStale = true;
+        pool.parallelFor(partitions, [&](size_t p) {
+            copy(outputs[p].begin(), outputs[p].end(), result.rows.begin() + offsets[p]);
+        });
+        return result;
+    }
+    // The original nested-loop join, kept as a reference for join().
+    Relation joinNestedLoop(const Relation& other) const {
         Scheme newScheme = scheme;
         for (const string& attr : other.scheme)
             if (find(newScheme.begin(), newScheme.end(), attr) == newScheme.end())
                 newScheme.push_back(attr);
-        Relation result(name, newScheme);
-        for (const Tuple& tuple1 : tuples) {
-            for (const Tuple& tuple2 : other.tuples) {
+        Relation result(name, newScheme, scratchResource());
+        for (const TupleRef& tuple1 : getTuples()) {
+            for (const TupleRef& tuple2 : other.getTuples()) {
                 Tuple newTuple = tuple1;
                 bool isJoinable = true;
                 for (size_t i = 0; i < other.scheme.size(); i++) {
                     auto it = find(scheme.begin(), scheme.end(), other.scheme[i]);
                     if (it != scheme.end()) {
                         size_t index = distance(scheme.begin(), it);
-                        if (index >= tuple1.size() || i >= tuple2.size() || tuple1[index] != tuple2[i]) {
+                        if (tuple1[index] != tuple2[i]) {
                             isJoinable = false;
                             break;
                         }
-                    } else {
-                        if (i < tuple2.size())
-                            newTuple.push_back(tuple2[i]);
-                        else {
-                            cerr << "Index out of bounds in join: " << i << endl;
-                            isJoinable = false;
-                        }
-                    }
+                    } else
+                        newTuple.push_back(tuple2[i]);
                 }
                 if (isJoinable)
                     result.addTuple(newTuple);
@@ -173,26 +1003,57 @@ public:
         return result;
     }
     void unionWith(const Relation& other) {
-        for (const Tuple& tuple : other.tuples)
-            tuples.insert(tuple);
+        if (other.arity != arity) {
+            cerr << "Union of arity " << other.arity << " into " << name << " of arity " << arity << endl;
+            return;
+        }
+        for (size_t r = 0; r < other.rowCount; r++)
+            addRow(other.row(r));
+    }
+    bool hasSameTuples(const Relation& other) const {
+        if (other.rowCount != rowCount || other.arity != arity)
+            return false;
+        for (size_t r = 0; r < rowCount; r++)
+            if (!other.contains(tuple(r)))
+                return false;
+        return true;
+    }
+    // Row numbers in output order.
+    vector<size_t> sortedRows() const {
+        return sortedRows(rows.data(), rowCount, arity);
+    }
+    // The same for 'count' rows stored one after another at 'values'.
+    static vector<size_t> sortedRows(const Symbol* values, size_t count, size_t arity) {
+        vector<size_t> order(count);
+        for (size_t r = 0; r < count; r++)
+            order[r] = r;
+        sort(order.begin(), order.end(), [values, arity](size_t a, size_t b) {
+            return TupleRef(values + a * arity, arity).lessByName(TupleRef(values + b * arity, arity));
+        });
+        return order;
     }
     string toString() const {
-        stringstream ss;
-        for (const Tuple& tuple : tuples)
-            ss << "  " << tuple.toString(scheme) << "\n";
-        return ss.str();
+        return toString(scheme);
+    }
+    // The rows under the attribute names of 'viewScheme', which must have
+    // the relation's arity.
+    string toString(const Scheme& viewScheme) const {
+        string text;
+        for (size_t r : sortedRows()) {
+            text += "  ";
+            tuple(r).appendTo(text, viewScheme);
+            text += '\n';
+        }
+        return text;
     }
     size_t size() const {
-        return tuples.size();
+        return rowCount;
     }
     const Scheme& getScheme() const {
         return scheme;
     }
-    set<Tuple>& getTuples() {
-        return tuples;
-    }
-    const set<Tuple>& getTuples() const {
-        return tuples;
+    TupleRange getTuples() const {
+        return TupleRange(this);
     }
 };
 
@@ -206,131 +1067,1708 @@ public:
     Relation& getRelation(const string& name) {
         return relations[name];
     }
+    const Relation& getRelation(const string& name) const {
+        static const Relation missing;
+        auto it = relations.find(name);
+        return it == relations.end() ? missing : it->second;
+    }
+    bool hasRelation(const string& name) const {
+        return relations.count(name) > 0;
+    }
+    const map<string, Relation>& getRelations() const {
+        return relations;
+    }
+    // Per-relation row and index memory, so index growth can be budgeted.
+    string statsString() const {
+        stringstream ss;
+        size_t rowTotal = 0;
+        size_t indexTotal = 0;
+        for (const auto& entry : relations) {
+            const Relation& relation = entry.second;
+            ss << entry.first << ": " << relation.size() << " rows, "
+               << relation.rowMemoryUsage() << " bytes; "
+               << relation.indexCount() << " indexes, "
+               << relation.indexMemoryUsage() << " bytes\n";
+            rowTotal += relation.rowMemoryUsage();
+            indexTotal += relation.indexMemoryUsage();
+        }
+        ss << "Total: " << rowTotal << " row bytes, " << indexTotal << " index bytes\n";
+        return ss.str();
+    }
+};
+
+// Binary image of an evaluated Database, the symbol table behind it and
+// the queries to ask of it, each with the relation that answers it. All
+// integers are native-endian; rows are 4-byte aligned so they can be
+// copied straight out of the mapping.
+//
+//   "DLSNAP\0\0"  version:u32  symbols:u64  relations:u64  queries:u64
+//   symbol:    string
+//   relation:  name:string  arity:u32  attribute:string * arity  rows:u64
+//              padding to 4 bytes  Symbol * (rows * arity)
+//   query:     name:string  source:string  count:u32  parameter:string * count
+//   string:    length:u32  bytes
+//
+// Version 1 files have no query sources; each query reads its own relation.
+class Snapshot {
+private:
+    static constexpr char magic[8] = {'D', 'L', 'S', 'N', 'A', 'P', 0, 0};
+    static const uint32_t version = 2;
+
+    // Bounds-checked cursor over the mapped file.
+    class Reader {
+    private:
+        string_view data;
+        size_t offset;
+    public:
+        Reader(string_view data) : data(data), offset(0) {}
+        const char* bytes(size_t count) {
+            if (count > data.size() - offset)
+                throw runtime_error("Truncated snapshot");
+            const char* start = data.data() + offset;
+            offset += count;
+            return start;
+        }
+        template <typename T>
+        T read() {
+            T value;
+            memcpy(&value, bytes(sizeof(T)), sizeof(T));
+            return value;
+        }
+        string readString() {
+            uint32_t length = read<uint32_t>();
+            return string(bytes(length), length);
+        }
+        void align(size_t alignment) {
+            bytes((alignment - offset % alignment) % alignment);
+        }
+    };
+    template <typename T>
+    static void write(ostream& out, T value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+    static void writeString(ostream& out, const string& value) {
+        write<uint32_t>(out, value.size());
+        out.write(value.data(), value.size());
+    }
+
+public:
+    static void save(const string& path, const Database& database, const vector<Predicate>& queries,
+                     const vector<string>& sources) {
+        ofstream out(path, ios::binary | ios::trunc);
+        if (!out)
+            throw runtime_error("Could not write snapshot: " + path);
+        const SymbolTable& symbols = SymbolTable::global();
+        out.write(magic, sizeof(magic));
+        write<uint32_t>(out, version);
+        write<uint64_t>(out, symbols.size());
+        write<uint64_t>(out, database.getRelations().size());
+        write<uint64_t>(out, queries.size());
+        for (size_t id = 0; id < symbols.size(); id++)
+            writeString(out, symbols.name(id));
+        for (const auto& entry : database.getRelations()) {
+            const Relation& relation = entry.second;
+            writeString(out, entry.first);
+            write<uint32_t>(out, relation.getScheme().size());
+            for (const string& attribute : relation.getScheme())
+                writeString(out, attribute);
+            write<uint64_t>(out, relation.size());
+            static const char padding[4] = {};
+            out.write(padding, (4 - out.tellp() % 4) % 4);
+            if (relation.size() > 0)
+                out.write(reinterpret_cast<const char*>(relation.row(0)),
+                          relation.size() * relation.getScheme().size() * sizeof(Symbol));
+        }
+        for (size_t q = 0; q < queries.size(); q++) {
+            const Predicate& query = queries[q];
+            writeString(out, query.name);
+            writeString(out, q < sources.size() ? sources[q] : query.name);
+            write<uint32_t>(out, query.parameters.size());
+            for (const Parameter& param : query.parameters)
+                writeString(out, param.value);
+        }
+        if (!out.flush())
+            throw runtime_error("Could not write snapshot: " + path);
+    }
+    // Interns the snapshot's symbols into the global table, remapping rows
+    // only if that table already held other symbols, and adds its
+    // relations to 'database'. Uniqueness tables and indexes are left to be
+    // built on first use.
+    static void load(const string& path, Database& database, vector<Predicate>& queries,
+                     vector<string>& sources) {
+        MappedFile file(path);
+        Reader reader(file.contents());
+        if (memcmp(reader.bytes(sizeof(magic)), magic, sizeof(magic)) != 0)
+            throw runtime_error("Not a snapshot: " + path);
+        uint32_t fileVersion = reader.read<uint32_t>();
+        if (fileVersion != version && fileVersion != 1)
+            throw runtime_error("Unsupported snapshot version " + to_string(fileVersion) + ": " + path);
+        uint64_t symbolCount = reader.read<uint64_t>();
+        uint64_t relationCount = reader.read<uint64_t>();
+        uint64_t queryCount = reader.read<uint64_t>();
+
+        SymbolTable& symbols = SymbolTable::global();
+        vector<Symbol> remap(symbolCount);
+        symbols.reserve(symbols.size() + symbolCount);
+        bool identity = true;
+        for (uint64_t id = 0; id < symbolCount; id++) {
+            remap[id] = symbols.intern(reader.readString());
+            identity = identity && remap[id] == id;
+        }
+
+        for (uint64_t r = 0; r < relationCount; r++) {
+            string name = reader.readString();
+            uint32_t arity = reader.read<uint32_t>();
+            vector<string> attributes;
+            for (uint32_t a = 0; a < arity; a++)
+                attributes.push_back(reader.readString());
+            uint64_t rowCount = reader.read<uint64_t>();
+            reader.align(4);
+            if (arity > 0 && rowCount > (SIZE_MAX / sizeof(Symbol)) / arity)
+                throw runtime_error("Truncated snapshot");
+            const Symbol* rows = reinterpret_cast<const Symbol*>(reader.bytes(rowCount * arity * sizeof(Symbol)));
+            Relation& relation = database.getRelation(name);
+            relation = Relation(name, Scheme(attributes));
+            for (size_t i = 0; i < rowCount * arity; i++)
+                if (rows[i] >= symbolCount)
+                    throw runtime_error("Corrupt snapshot: " + path);
+            if (identity) {
+                relation.appendDistinctRows(rows, rowCount);
+            } else {
+                vector<Symbol> mapped(rows, rows + rowCount * arity);
+                for (Symbol& value : mapped)
+                    value = remap[value];
+                relation.appendDistinctRows(mapped.data(), rowCount);
+            }
+        }
+
+        for (uint64_t q = 0; q < queryCount; q++) {
+            Predicate query(reader.readString());
+            sources.push_back(fileVersion >= 2 ? reader.readString() : query.name);
+            uint32_t count = reader.read<uint32_t>();
+            for (uint32_t p = 0; p < count; p++)
+                query.addParameter(Parameter(reader.readString()));
+            queries.push_back(move(query));
+        }
+    }
+};
+
+// A body atom or query compiled to column operations on its relation.
+struct AtomPlan {
+    string relationName;
+    size_t arity;
+    bool satisfiable;                   // false when a constant is unknown
+    vector<int> constantColumns;
+    vector<Symbol> constantValues;
+    vector<pair<int, int>> equalColumns;
+    vector<int> projectColumns;         // first occurrence of each variable
+    Scheme scheme;                      // the variables, in that order
+};
+
+// The order in which a rule joins its body atoms, with the column mappings
+// for that order. Kept until the atom sizes it was planned for drift.
+struct JoinOrder {
+    vector<int> atoms;
+    vector<JoinColumns> joins;          // joins[k - 1] joins atoms[k] onto atoms[0..k-1]
+    vector<int> headColumns;            // head variables within the joined scheme
+    vector<double> estimates;           // estimated size after each step
+    vector<size_t> plannedSizes;        // atom result sizes it was planned for
+};
+
+// A rule compiled once after parsing, so that the fixpoint loop only runs
+// integer column operations instead of matching attribute names again.
+struct RulePlan {
+    bool valid;
+    string headName;
+    Scheme headScheme;
+    vector<string> headVariables;
+    vector<AtomPlan> atoms;
+    JoinOrder sourceOrder;              // body atoms left to right
+    // Cost-based orders: orders[0] for a full evaluation, orders[i + 1]
+    // for the semi-naive variant reading the delta of atom i.
+    vector<JoinOrder> orders;
+    string explanation;                 // explain output not yet printed
+    vector<Profiler::Operator> operators;   // profile not yet recorded
+};
+
+// A rule's variables numbered across its body, so that incremental
+// maintenance can evaluate it one binding at a time.
+struct RuleBindings {
+    vector<vector<int>> atomVariables;  // variable of each projected column, per atom
+    vector<int> headVariables;
+    size_t variableCount;
+};
+
+// Magic-set rewriting of a program for its queries. Each derived
+// predicate p is specialised per adornment, a string with 'b' for a bound
+// argument and 'f' for a free one, into p$<adornment>. Bound adornments
+// are guarded by magic$p$<adornment>, which holds the argument values that
+// are actually asked for, seeded from the query constants and passed along
+// rule bodies left to right. '$' cannot occur in a parsed name, so the new
+// relations never clash with the program's own.
+class MagicSets {
+public:
+    struct Program {
+        vector<Rule> rules;
+        vector<Predicate> schemes;          // relations the rules add
+        vector<Predicate> facts;            // magic seeds and constants
+        vector<string> querySources;        // relation each query reads
+    };
+
+    static string adornedName(const string& name, const string& adornment) {
+        return name + "$" + adornment;
+    }
+    static string magicName(const string& name, const string& adornment) {
+        return "magic$" + adornedName(name, adornment);
+    }
+    static bool isConstant(const string& value) {
+        return !value.empty() && value.front() == '\'';
+    }
+
+    // 'database' must already hold the program's schemes and facts.
+    static Program rewrite(const vector<Rule>& rules, const vector<Predicate>& queries,
+                           const Database& database) {
+        Rewriter rewriter(rules, database);
+        for (const Predicate& query : queries)
+            rewriter.addQuery(query);
+        rewriter.run();
+        return rewriter.result;
+    }
+
+private:
+    class Rewriter {
+    public:
+        const vector<Rule>& rules;
+        const Database& database;
+        Program result;
+        set<string> derived;
+        set<pair<string, string>> adorned;
+        vector<pair<string, string>> pending;
+        map<string, string> constantRelations;
+
+        Rewriter(const vector<Rule>& rules, const Database& database)
+            : rules(rules), database(database) {
+            for (const Rule& rule : rules)
+                derived.insert(rule.headPredicate.name);
+        }
+        void addQuery(const Predicate& query) {
+            if (!derived.count(query.name)) {
+                result.querySources.push_back(query.name);
+                return;
+            }
+            string adornment;
+            Predicate seed(magicName(query.name, ""));
+            for (const Parameter& param : query.parameters) {
+                adornment += isConstant(param.value) ? 'b' : 'f';
+                if (isConstant(param.value))
+                    seed.addParameter(param);
+            }
+            seed.name = magicName(query.name, adornment);
+            if (!seed.parameters.empty())
+                result.facts.push_back(seed);
+            require(query.name, adornment);
+            result.querySources.push_back(adornedName(query.name, adornment));
+        }
+        void run() {
+            while (!pending.empty()) {
+                pair<string, string> next = pending.back();
+                pending.pop_back();
+                for (const Rule& rule : rules)
+                    if (rule.headPredicate.name == next.first)
+                        rewriteRule(rule, next.second);
+            }
+        }
+
+    private:
+        // Creates p$adornment and its magic relation the first time they
+        // are needed, and queues p's rules for that adornment.
+        void require(const string& name, const string& adornment) {
+            if (!adorned.insert({name, adornment}).second)
+                return;
+            const Scheme& scheme = database.getRelation(name).getScheme();
+            Predicate relation(adornedName(name, adornment));
+            Predicate magic(magicName(name, adornment));
+            for (size_t i = 0; i < scheme.size(); i++) {
+                relation.addParameter(Parameter(scheme[i]));
+                if (i < adornment.size() && adornment[i] == 'b')
+                    magic.addParameter(Parameter(scheme[i]));
+            }
+            result.schemes.push_back(relation);
+            if (!magic.parameters.empty())
+                result.schemes.push_back(magic);
+            pending.push_back({name, adornment});
+            // Facts stored under p itself still count as answers.
+            if (database.getRelation(name).size() > 0) {
+                Predicate head(relation.name);
+                Predicate base(name);
+                Predicate guard(magic.name);
+                for (size_t i = 0; i < scheme.size(); i++) {
+                    Parameter variable("$v" + to_string(i));
+                    head.addParameter(variable);
+                    base.addParameter(variable);
+                    if (i < adornment.size() && adornment[i] == 'b')
+                        guard.addParameter(variable);
+                }
+                Rule rule(head);
+                if (!guard.parameters.empty())
+                    rule.addBodyPredicate(guard);
+                rule.addBodyPredicate(base);
+                result.rules.push_back(rule);
+            }
+        }
+        // A relation holding just 'value', so that a constant can reach a
+        // magic rule's head as a variable.
+        string constantRelation(const string& value) {
+            auto it = constantRelations.find(value);
+            if (it != constantRelations.end())
+                return it->second;
+            string name = "const$" + to_string(constantRelations.size());
+            constantRelations[value] = name;
+            Predicate scheme(name);
+            scheme.addParameter(Parameter("V"));
+            result.schemes.push_back(scheme);
+            Predicate fact(name);
+            fact.addParameter(Parameter(value));
+            result.facts.push_back(fact);
+            return name;
+        }
+        void rewriteRule(const Rule& rule, const string& adornment) {
+            const Predicate& head = rule.headPredicate;
+            set<string> bound;
+            vector<Predicate> body;
+            Predicate guard(magicName(head.name, adornment));
+            for (size_t i = 0; i < head.parameters.size() && i < adornment.size(); i++) {
+                if (adornment[i] == 'b') {
+                    guard.addParameter(head.parameters[i]);
+                    bound.insert(head.parameters[i].value);
+                }
+            }
+            if (!guard.parameters.empty())
+                body.push_back(guard);
+
+            for (const Predicate& atom : rule.bodyPredicates) {
+                if (!derived.count(atom.name)) {
+                    body.push_back(atom);
+                } else {
+                    string atomAdornment;
+                    Predicate magicHead(magicName(atom.name, ""));
+                    vector<Predicate> magicBody = body;
+                    for (const Parameter& param : atom.parameters) {
+                        bool isBound = isConstant(param.value) || bound.count(param.value);
+                        atomAdornment += isBound ? 'b' : 'f';
+                        if (!isBound)
+                            continue;
+                        if (isConstant(param.value)) {
+                            Parameter variable("$c" + to_string(magicBody.size()));
+                            Predicate constant(constantRelation(param.value));
+                            constant.addParameter(variable);
+                            magicBody.push_back(constant);
+                            magicHead.addParameter(variable);
+                        } else {
+                            magicHead.addParameter(param);
+                        }
+                    }
+                    magicHead.name = magicName(atom.name, atomAdornment);
+                    require(atom.name, atomAdornment);
+                    if (!magicHead.parameters.empty()) {
+                        Rule magicRule(magicHead);
+                        for (Predicate& predicate : magicBody)
+                            magicRule.addBodyPredicate(move(predicate));
+                        result.rules.push_back(move(magicRule));
+                    }
+                    Predicate renamed(adornedName(atom.name, atomAdornment));
+                    renamed.parameters = atom.parameters;
+                    body.push_back(renamed);
+                }
+                for (const Parameter& param : atom.parameters)
+                    if (!isConstant(param.value))
+                        bound.insert(param.value);
+            }
+
+            Predicate adornedHead(adornedName(head.name, adornment));
+            adornedHead.parameters = head.parameters;
+            Rule rewritten(adornedHead);
+            for (Predicate& predicate : body)
+                rewritten.addBodyPredicate(move(predicate));
+            result.rules.push_back(move(rewritten));
+        }
+    };
+};
+
+// What rule and query output looks like. READABLE_OUTPUT is the usual
+// listing. SUMMARY_OUTPUT keeps its headings and rules but gives only how
+// many tuples each rule added and each query found. TSV_OUTPUT has nothing
+// but tuples, one per line: the relation a rule added it to or the query it
+// answers, then its values, all separated by tabs.
+enum OutputFormat {
+    READABLE_OUTPUT,
+    SUMMARY_OUTPUT,
+    TSV_OUTPUT
 };
 
 class Interpreter {
 private:
     DatalogProgram datalogProgram;
     Database database;
+    vector<RulePlan> plans;
+    bool semiNaive;
+    bool stratified;
+    bool componentOutput;
+    bool reorderJoins;
+    bool explain;
+    unique_ptr<ThreadPool> pool;
+    bool loaded;
+    bool evaluated;
+    bool demandDriven;
+    vector<string> querySources;        // relation each query reads, if not its own
+    // The facts given for relations that rules also derive, kept apart so
+    // that retracting one can tell it from a derived tuple.
+    map<string, Relation> baseFacts;
+    vector<RuleBindings> bindings;
+    set<string> undeclaredFacts;        // relations of facts already reported
+    Profiler* profiler;
+    vector<unique_ptr<Arena>> arenas;   // for rule intermediates, reset every pass
+    bool arenaAllocation;
+    string profiledComponent;           // component and pass being evaluated
+    int profiledPass;
+    OutputFormat outputFormat;
+    OutputWriter output;                // flushed at the end of rule and query evaluation
 public:
-    Interpreter(const DatalogProgram& dp) : datalogProgram(dp) {}
-    void evaluateSchemes() {
-        for (const auto& scheme : datalogProgram.schemes) {
-            vector<string> attributes;
-            for (const auto& param : scheme.parameters)
-                attributes.push_back(param.value);
-            Relation relation(scheme.name, Scheme(attributes));
-            database.addRelation(scheme.name, relation);
+    Interpreter()
+        : semiNaive(true), stratified(false), componentOutput(false), reorderJoins(true), explain(false), loaded(false),
+          evaluated(false), demandDriven(false), profiler(nullptr),
+          arenaAllocation(true), profiledPass(0), outputFormat(READABLE_OUTPUT), output(cout) {}
+    Interpreter(const DatalogProgram& dp)
+        : datalogProgram(dp), semiNaive(true), stratified(false), componentOutput(false), reorderJoins(true), explain(false),
+          loaded(false), evaluated(false), demandDriven(false), profiler(nullptr),
+          arenaAllocation(true), profiledPass(0), outputFormat(READABLE_OUTPUT), output(cout) {}
+    // The naive engine re-evaluates every rule against the full relations on
+    // each pass; it is kept for cross-checking the semi-naive one.
+    void setSemiNaive(bool enabled) {
+        semiNaive = enabled;
+    }
+    // Stratified evaluation runs each strongly connected component of the
+    // rule dependency graph to its own fixpoint, in dependency order. Off by
+    // default, where one global fixpoint runs over all rules; the query
+    // answers are the same, but the rules print in component order and the
+    // pass count is the sum of the components' passes.
+    void setStratified(bool enabled) {
+        stratified = enabled;
+    }
+    // With stratification, prints the dependency graph and brackets each
+    // component's rules with "SCC: ..." and "N passes: ..." lines in place
+    // of the total pass count.
+    void setComponentOutput(bool enabled) {
+        componentOutput = enabled;
+    }
+    // Cost-based join ordering; when disabled, body atoms join left to right.
+    void setJoinReordering(bool enabled) {
+        reorderJoins = enabled;
+    }
+    // Explain mode prints each rule's join order with estimated and actual
+    // intermediate sizes after the rule's output.
+    void setExplain(bool enabled) {
+        explain = enabled;
+    }
+    // Demand-driven mode rewrites the rules with magic sets for the
+    // queries, so only facts relevant to their constants are derived. Query
+    // answers are the same; the rule evaluation output is that of the
+    // rewritten rules.
+    void setDemandDriven(bool enabled) {
+        demandDriven = enabled;
+    }
+    // Records phase times and every rule evaluation into 'profiler', which
+    // must outlive the interpreter's use of it; null turns profiling off.
+    void setProfiler(Profiler* profiler) {
+        this->profiler = profiler;
+    }
+    // The intermediate relations of each rule evaluation are allocated from
+    // an arena that is reset once the pass has merged the results. When
+    // disabled, they come from the heap, with the same allocation counts.
+    void setArenaAllocation(bool enabled) {
+        arenaAllocation = enabled;
+        for (auto& arena : arenas)
+            arena->setBumping(enabled);
+    }
+    // Allocation counts and high-water marks of the intermediates, summed
+    // over the arenas.
+    Arena::Stats arenaStats() const {
+        Arena::Stats total;
+        for (const auto& arena : arenas) {
+            const Arena::Stats& stats = arena->stats();
+            total.allocations += stats.allocations;
+            total.bytes += stats.bytes;
+            total.highWater += stats.highWater;
+            total.blocks += stats.blocks;
+            total.resets += stats.resets;
         }
+        return total;
+    }
+    // Readable by default; see OutputFormat.
+    void setOutputFormat(OutputFormat format) {
+        outputFormat = format;
+    }
+    // Sorts and formats each rule's new tuples on a thread of its own while
+    // evaluation goes on. The output is the same.
+    void setBackgroundOutput(bool enabled) {
+        output.setBackground(enabled);
+    }
+    // Rules within a pass are evaluated on this many threads; the output is
+    // the same as with one thread.
+    void setThreadCount(size_t threadCount) {
+        if (Relation::parallelJoinPool() == pool.get())
+            Relation::setParallelJoin(nullptr, Relation::parallelJoinThreshold());
+        pool.reset(threadCount > 1 ? new ThreadPool(threadCount) : nullptr);
+        Relation::setParallelJoin(pool.get(), Relation::parallelJoinThreshold());
+    }
+    // Joins with at least this many input rows are partitioned across the
+    // thread pool as well.
+    void setParallelJoinThreshold(size_t rows) {
+        Relation::setParallelJoin(Relation::parallelJoinPool(), rows);
+    }
+    ~Interpreter() {
+        if (pool && Relation::parallelJoinPool() == pool.get())
+            Relation::setParallelJoin(nullptr, Relation::parallelJoinThreshold());
+    }
+    void evaluateSchemes() {
+        for (const auto& scheme : datalogProgram.schemes)
+            addScheme(scheme);
+    }
+    void addScheme(const Predicate& scheme) {
+        vector<string> attributes;
+        for (const auto& param : scheme.parameters)
+            attributes.push_back(param.value);
+        Relation relation(scheme.name, Scheme(attributes));
+        database.addRelation(scheme.name, relation);
+    }
+    // Replaces the rules with their magic-set rewriting for the queries.
+    // Rules are checked first, so problems are reported as written and
+    // invalid rules are left out of the rewriting.
+    void rewriteForQueries() {
+        Profiler::Timer timer(profiler, "rewrite");
+        compileRules();
+        vector<Rule> validRules;
+        for (size_t r = 0; r < plans.size(); r++)
+            if (plans[r].valid)
+                validRules.push_back(datalogProgram.rules[r]);
+        MagicSets::Program rewritten = MagicSets::rewrite(validRules, datalogProgram.queries, database);
+        for (const Predicate& scheme : rewritten.schemes)
+            addScheme(scheme);
+        for (const Predicate& fact : rewritten.facts)
+            addFact(fact);
+        datalogProgram.rules = move(rewritten.rules);
+        querySources = move(rewritten.querySources);
+        plans.clear();
     }
     void evaluateFacts() {
-        for (const auto& fact : datalogProgram.facts) {
-            vector<string> values;
-            for (const auto& param : fact.parameters)
-                values.push_back(param.value);
-            Tuple tuple(values);
-            database.getRelation(fact.name).addTuple(tuple);
+        // Rule and query constants join the sorted batch so that interning
+        // them later cannot put IDs out of string order.
+        set<string> constants = datalogProgram.domain;
+        for (const Rule& rule : datalogProgram.rules)
+            for (const Predicate& predicate : rule.bodyPredicates)
+                addConstants(predicate, constants);
+        for (const Predicate& query : datalogProgram.queries)
+            addConstants(query, constants);
+        SymbolTable::global().internAll(constants);
+        for (const auto& fact : datalogProgram.facts)
+            addFact(fact);
+    }
+    // A fact for an undeclared relation is reported, once per name, and
+    // skipped without creating the relation.
+    void addFact(const Predicate& fact) {
+        if (!database.hasRelation(fact.name)) {
+            if (undeclaredFacts.insert(fact.name).second)
+                cerr << "In fact " << trimTrailingPeriod(fact.toString()) << ": no scheme named " << fact.name << endl;
+            return;
+        }
+        Tuple tuple;
+        tuple.reserve(fact.parameters.size());
+        for (const auto& param : fact.parameters)
+            tuple.push_back(SymbolTable::global().intern(param.value));
+        database.getRelation(fact.name).addTuple(tuple);
+    }
+    // Feeds streamed facts straight into their relations.
+    class DatabaseSink : public FactSink {
+    private:
+        Interpreter& interpreter;
+    public:
+        DatabaseSink(Interpreter& interpreter) : interpreter(interpreter) {}
+        void beginFacts(const DatalogProgram& program) override {
+            interpreter.datalogProgram.schemes = program.schemes;
+            interpreter.evaluateSchemes();
+        }
+        void addFact(const Predicate& fact) override {
+            interpreter.addFact(fact);
+        }
+    };
+    // Loads a program by pulling tokens from 'in' a chunk at a time. Facts
+    // go straight into their relations and are never kept in the
+    // DatalogProgram, so memory stays close to the relations themselves.
+    // interpret() then starts from the rules.
+    void loadStream(istream& in) {
+        Profiler::Timer timer(profiler, "parse");
+        StreamScanner scanner(in);
+        Parser parser(scanner);
+        DatabaseSink sink(*this);
+        parser.setFactSink(&sink);
+        parser.parse();
+        datalogProgram = move(parser.datalogProgram);
+        loaded = true;
+    }
+    // Creates the relations and adds the program's facts, once.
+    void loadProgram() {
+        if (loaded)
+            return;
+        Profiler::Timer timer(profiler, "load");
+        evaluateSchemes();
+        evaluateFacts();
+        loaded = true;
+    }
+    // Adds the rows of a CSV or TSV file to a relation declared in Schemes,
+    // after the program's own facts. Each field becomes the string constant
+    // 'field'. In CSV, fields may be double-quoted, with "" for a quote.
+    // Rows with the wrong number of fields are reported and skipped.
+    // Returns the number of new rows.
+    size_t loadDelimited(const string& relationName, const string& path, char delimiter) {
+        loadProgram();
+        if (!database.hasRelation(relationName))
+            throw runtime_error("No scheme declared for " + relationName + ": " + path);
+        Relation& relation = database.getRelation(relationName);
+        size_t arity = relation.getScheme().size();
+        MappedFile file(path);
+        string_view input = file.contents();
+
+        // A batch of rows is parsed into 'text', each value quoted and
+        // ending at ends[k], and then interned and inserted in one go.
+        const size_t batchRows = 1 << 16;
+        string text;
+        vector<size_t> ends;
+        vector<uint32_t> hashes;
+        vector<Symbol> batch;
+        size_t added = 0;
+        auto flush = [&]() {
+            SymbolTable& symbols = SymbolTable::global();
+            symbols.reserve(symbols.size() + ends.size());
+            hashes.resize(ends.size());
+            for (size_t k = 0; k < ends.size(); k++)
+                hashes[k] = SymbolTable::hashName(string_view(text).substr(k ? ends[k - 1] : 0,
+                                                                        ends[k] - (k ? ends[k - 1] : 0)));
+            const size_t lookahead = 16;
+            batch.resize(ends.size());
+            for (size_t k = 0; k < ends.size(); k++) {
+                if (k + lookahead < ends.size())
+                    symbols.prefetch(hashes[k + lookahead]);
+                size_t begin = k ? ends[k - 1] : 0;
+                batch[k] = symbols.intern(string_view(text).substr(begin, ends[k] - begin), hashes[k]);
+            }
+            if (arity > 0)
+                added += relation.addRows(batch.data(), batch.size() / arity);
+            text.clear();
+            ends.clear();
+        };
+
+        size_t i = 0;
+        for (int line = 1; i < input.size(); line++) {
+            size_t recordText = text.size();
+            size_t recordEnds = ends.size();
+            bool quoted = false;
+            while (true) {
+                text += '\'';
+                if (delimiter == ',' && i < input.size() && input[i] == '"') {
+                    quoted = true;
+                    for (i++; i < input.size(); i++) {
+                        if (input[i] == '"') {
+                            if (i + 1 < input.size() && input[i + 1] == '"')
+                                i++;
+                            else
+                                break;
+                        }
+                        if (input[i] == '\n')
+                            line++;
+                        text += input[i];
+                    }
+                    if (i < input.size())
+                        i++;
+                }
+                size_t end = i;
+                while (end < input.size() && input[end] != delimiter && input[end] != '\n')
+                    end++;
+                size_t length = end - i;
+                if (end < input.size() && input[end] == '\n' && length > 0 && input[end - 1] == '\r')
+                    length--;
+                text.append(input.data() + i, length);
+                text += '\'';
+                ends.push_back(text.size());
+                i = end;
+                if (i < input.size() && input[i] == delimiter) {
+                    i++;
+                    continue;
+                }
+                i++;
+                break;
+            }
+            size_t count = ends.size() - recordEnds;
+            bool blank = count == 1 && !quoted && text.size() - recordText == 2;
+            if (!blank && count != arity)
+                cerr << path << ":" << line << ": " << count << " fields, but " << relationName
+                     << " has " << arity << endl;
+            if (blank || count != arity) {
+                text.resize(recordText);
+                ends.resize(recordEnds);
+            } else if (ends.size() >= batchRows * arity) {
+                flush();
+            }
+        }
+        flush();
+        return added;
+    }
+    // Writes the database as evaluated so far, with the program's queries,
+    // for loadSnapshot() to pick up in a later run.
+    void saveSnapshot(const string& path) const {
+        Snapshot::save(path, database, datalogProgram.queries, querySources);
+    }
+    // Replaces loading and rule evaluation: interpret() then only answers
+    // the snapshot's queries.
+    void loadSnapshot(const string& path) {
+        datalogProgram.queries.clear();
+        querySources.clear();
+        Snapshot::load(path, database, datalogProgram.queries, querySources);
+        evaluated = true;
+    }
+    // False after demand-driven evaluation, or after loading a snapshot of
+    // it: the queries are then answered from rewritten relations that hold
+    // only what those queries needed, not from the relations they name.
+    bool queriesReadOwnRelations() const {
+        for (size_t q = 0; q < querySources.size() && q < datalogProgram.queries.size(); q++)
+            if (querySources[q] != datalogProgram.queries[q].name)
+                return false;
+        return true;
+    }
+    // Adds facts and, once the rules have been evaluated, derives what
+    // follows from them semi-naively: each round only joins the tuples new
+    // in the round before against the stored relations, one tuple at a time
+    // through indexes. Returns the number of new facts.
+    size_t insertFacts(const vector<Predicate>& facts) {
+        prepareUpdate();
+        map<string, Relation> delta;
+        size_t added = 0;
+        for (const Predicate& fact : facts) {
+            if (!database.hasRelation(fact.name)) {
+                cerr << "No scheme named " << fact.name << endl;
+                continue;
+            }
+            Relation& relation = database.getRelation(fact.name);
+            Tuple tuple;
+            for (const Parameter& param : fact.parameters)
+                tuple.push_back(SymbolTable::global().intern(param.value));
+            auto base = baseFacts.find(fact.name);
+            if (base != baseFacts.end() && tuple.size() == relation.getScheme().size())
+                base->second.addTuple(tuple);
+            if (relation.addTuple(tuple)) {
+                deltaFor(delta, fact.name).addTuple(tuple);
+                added++;
+            }
         }
+        if (evaluated)
+            propagateInserts(delta);
+        return added;
+    }
+    // Removes facts and, once the rules have been evaluated, maintains the
+    // derived relations by delete-and-rederive: everything derived through
+    // a removed fact is deleted, then whatever still has another derivation
+    // is put back. Only given facts can be retracted, not derived tuples.
+    // Returns the number of facts removed.
+    size_t retractFacts(const vector<Predicate>& facts) {
+        prepareUpdate();
+        map<string, Relation> removed;
+        size_t retracted = 0;
+        for (const Predicate& fact : facts) {
+            if (!database.hasRelation(fact.name))
+                continue;
+            Tuple tuple;
+            Symbol id;
+            for (const Parameter& param : fact.parameters)
+                if (SymbolTable::global().lookup(param.value, id))
+                    tuple.push_back(id);
+            if (tuple.size() != fact.parameters.size() || !database.getRelation(fact.name).contains(tuple))
+                continue;
+            auto base = baseFacts.find(fact.name);
+            if (base != baseFacts.end() && !base->second.removeTuple(tuple))
+                continue;
+            if (deltaFor(removed, fact.name).addTuple(tuple))
+                retracted++;
+        }
+
+        // Over-delete, against the database as it was.
+        map<string, Relation> delta = evaluated ? removed : map<string, Relation>();
+        while (!delta.empty()) {
+            map<string, Relation> next;
+            forEachConsequence(delta, [&](const RulePlan& plan, const Tuple& head) {
+                if (deltaFor(removed, plan.headName).addTuple(head))
+                    deltaFor(next, plan.headName).addTuple(head);
+            });
+            delta = move(next);
+        }
+        for (const auto& entry : removed) {
+            Relation& relation = database.getRelation(entry.first);
+            for (TupleRef tuple : entry.second.getTuples())
+                relation.removeTuple(tuple);
+        }
+
+        // Rederive what has a derivation left, then what follows from that.
+        map<string, Relation> rederived;
+        for (const auto& entry : removed) {
+            auto base = baseFacts.find(entry.first);
+            if (base == baseFacts.end())
+                continue;
+            for (TupleRef tuple : entry.second.getTuples())
+                if (base->second.contains(tuple) || derivable(entry.first, tuple))
+                    deltaFor(rederived, entry.first).addTuple(tuple);
+        }
+        for (const auto& entry : rederived)
+            database.getRelation(entry.first).unionWith(entry.second);
+        propagateInserts(rederived);
+        return retracted;
+    }
+    static void addConstants(const Predicate& predicate, set<string>& constants) {
+        for (const Parameter& param : predicate.parameters)
+            if (!param.value.empty() && param.value.front() == '\'')
+                constants.insert(param.value);
     }
     void evaluateRules() {
+        Profiler::Timer timer(profiler, "evaluate");
+        if (plans.size() != datalogProgram.rules.size())
+            compileRules();
+        vector<int> allRules;
+        for (size_t r = 0; r < datalogProgram.rules.size(); r++)
+            allRules.push_back(r);
+        // marks[r][i]: size of body relation i when rule r last ran, so that
+        // everything past it is the delta the rule has not seen yet.
+        vector<vector<size_t>> marks(datalogProgram.rules.size());
+        if (!stratified) {
+            writeHeading("Rule Evaluation\n");
+            int iterationCount = evaluateComponent(allRules, true, marks);
+            writeHeading("\nSchemes populated after " + to_string(iterationCount) + " passes through the Rules.\n");
+            releaseArenas();
+            output.flush();
+            return;
+        }
+        Graph graph = makeGraph(datalogProgram.rules);
+        if (componentOutput)
+            writeHeading("Dependency Graph\n" + graph.toString() + "\n");
+        writeHeading("Rule Evaluation\n");
+        int totalPasses = 0;
+        vector<set<int>> components = graph.findSCCs();
+        for (size_t c = 0; c < components.size(); ) {
+            vector<int> ruleIDs(components[c].begin(), components[c].end());
+            bool recursive = ruleIDs.size() > 1 || graph.hasEdge(ruleIDs[0], ruleIDs[0]);
+            if (!recursive && pool) {
+                // A run of non-recursive single-rule components is one
+                // parallel batch; the merge fixes up any dependencies in it.
+                vector<int> batch;
+                for (; c < components.size() && components[c].size() == 1; c++) {
+                    int r = *components[c].begin();
+                    if (graph.hasEdge(r, r))
+                        break;
+                    batch.push_back(r);
+                }
+                evaluatePass(batch, marks, true);
+                totalPasses += batch.size();
+                continue;
+            }
+            string names = ruleNames(ruleIDs);
+            if (componentOutput)
+                writeHeading("SCC: " + names + "\n");
+            int iterationCount = evaluateComponent(ruleIDs, recursive, marks);
+            if (componentOutput)
+                writeHeading(to_string(iterationCount) + " passes: " + names + "\n");
+            totalPasses += iterationCount;
+            c++;
+        }
+        if (!componentOutput)
+            writeHeading("\nSchemes populated after " + to_string(totalPasses) + " passes through the Rules.\n");
+        releaseArenas();
+        // Background formatting reads the relations and the symbol table.
+        output.flush();
+    }
+    // The arenas keep their blocks from pass to pass, but not beyond rule
+    // evaluation, so that a long-lived interpreter does not hold on to the
+    // largest pass's scratch memory.
+    void releaseArenas() {
+        for (auto& arena : arenas)
+            arena->release();
+    }
+    // Runs the given rules to a fixpoint, or exactly once when they cannot
+    // feed themselves, and returns the number of passes made.
+    int evaluateComponent(const vector<int>& ruleIDs, bool recursive, vector<vector<size_t>>& marks) {
         int iterationCount = 0;
         bool databaseChanged = true;
-        cout << "Rule Evaluation\n";
+        if (profiler)
+            profiledComponent = ruleNames(ruleIDs);
         while (databaseChanged) {
-            databaseChanged = false;
             ++iterationCount;
-            for (const Rule& rule : datalogProgram.rules) {
-                Relation result = evaluateRule(rule);
-                Relation& existingRelation = database.getRelation(rule.headPredicate.name);
-                size_t initialSize = existingRelation.size();
-                Relation newTuples = result;
-                for (const Tuple& tuple : existingRelation.getTuples())
-                    newTuples.getTuples().erase(tuple);
-                existingRelation.unionWith(result);
-                if (existingRelation.size() > initialSize)
-                    databaseChanged = true;
-                cout << trimTrailingPeriod(rule.toString()) << "\n";
-                cout << newTuples.toString();
-            }
-        }
-        cout << "\nSchemes populated after " << iterationCount << " passes through the Rules.\n";
-    }
-    Relation evaluateRule(const Rule& rule) {
-        Relation result;
-        vector<Relation> intermediateResults;
-        for (const Predicate& predicate : rule.bodyPredicates)
-            intermediateResults.push_back(evaluateQuery(predicate));
-        if (intermediateResults.size() > 1) {
-            result = intermediateResults[0];
-            for (size_t i = 1; i < intermediateResults.size(); i++)
-                result = result.join(intermediateResults[i]);
-        } else if (intermediateResults.size() == 1) {
-            result = intermediateResults[0];
-        }
-        vector<int> indices;
-        vector<string> newAttributes;
-        Relation& headRelation = database.getRelation(rule.headPredicate.name);
-        const Scheme& targetScheme = headRelation.getScheme();
-        if (targetScheme.size() != rule.headPredicate.parameters.size())
-            cerr << "Mismatch in number of attributes between rule head and target scheme." << endl;
-        for (size_t j = 0; j < rule.headPredicate.parameters.size(); j++) {
-            string variable = rule.headPredicate.parameters[j].value;
-            bool found = false;
-            for (size_t i = 0; i < result.getScheme().size(); i++) {
-                if (result.getScheme()[i] == variable) {
-                    indices.push_back(i);
-                    newAttributes.push_back(targetScheme[j]);
-                    found = true;
-                    break;
-                }
-            }
-            if (!found)
-                cerr << "Attribute not found during evaluateRule(): " << variable << endl;
+            profiledPass = iterationCount;
+            databaseChanged = evaluatePass(ruleIDs, marks, false);
+            if (!recursive)
+                break;
         }
-        result = result.project(indices);
-        result = result.rename(newAttributes);
-        return result;
+        return iterationCount;
     }
-    void evaluateQueries() {
-        cout << "\nQuery Evaluation\n";
-        for (const auto& query : datalogProgram.queries) {
-            Relation result = evaluateQuery(query);
-            cout << trimTrailingPeriod(query.toString()) << "? ";
-            if (result.size() == 0)
-                cout << "No\n";
+    // One pass over the rules, printing each rule's new tuples, and whether
+    // anything was added. With a thread pool every rule is first evaluated
+    // against the database as it was at the start of the pass. The results
+    // are then merged in rule order, and each one is topped up with a
+    // semi-naive step over the tuples that earlier rules added in this pass.
+    // That makes the output the same as running the rules one after another.
+    // With 'asComponents' each rule counts as its own one-pass component.
+    bool evaluatePass(const vector<int>& ruleIDs, vector<vector<size_t>>& marks, bool asComponents) {
+        bool parallel = pool && ruleIDs.size() > 1;
+        // Each rule's intermediates live in its own arena until its result
+        // is merged; a sequential pass reuses one arena rule after rule.
+        for (size_t k = arenas.size(); k < (parallel ? ruleIDs.size() : 1); k++) {
+            arenas.emplace_back(new Arena());
+            arenas.back()->setBumping(arenaAllocation);
+        }
+        vector<unique_ptr<Relation>> results(ruleIDs.size());
+        vector<vector<size_t>> snapshot(ruleIDs.size());
+        vector<double> seconds(profiler ? ruleIDs.size() : 0);
+        if (parallel) {
+            for (size_t k = 0; k < ruleIDs.size(); k++)
+                snapshot[k] = bodySizes(ruleIDs[k]);
+            prepareForParallel(ruleIDs);
+            pool->parallelFor(ruleIDs.size(), [&](size_t k) {
+                auto start = profiler ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+                Relation::ScratchScope scope(arenas[k].get());
+                results[k].reset(new Relation(evaluateRuleFrom(ruleIDs[k], marks[ruleIDs[k]])));
+                if (profiler)
+                    seconds[k] = Profiler::secondsSince(start);
+            });
+        }
+        bool databaseChanged = false;
+        for (size_t k = 0; k < ruleIDs.size(); k++) {
+            int r = ruleIDs[k];
+            const Rule& rule = datalogProgram.rules[r];
+            vector<size_t> current = bodySizes(r);
+            auto start = profiler ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+            if (!parallel)
+                arenas[0]->reset();
+            Relation::ScratchScope scope(arenas[parallel ? k : 0].get());
+            Relation result = parallel ? move(*results[k]) : evaluateRuleFrom(r, marks[r]);
+            if (parallel && current != snapshot[k])
+                result.unionWith(evaluateRuleDelta(r, snapshot[k]));
+            if (profiler)
+                seconds[k] += Profiler::secondsSince(start);
+            if (semiNaive)
+                marks[r] = current;
+            Relation& existingRelation = database.getRelation(rule.headPredicate.name);
+            size_t initialSize = existingRelation.size();
+            existingRelation.unionWith(result);
+            if (existingRelation.size() > initialSize)
+                databaseChanged = true;
+            if (profiler) {
+                profiler->addRuleEvaluation({r, trimTrailingPeriod(rule.toString()),
+                                             asComponents ? "R" + to_string(r) : profiledComponent,
+                                             asComponents ? 1 : profiledPass, seconds[k], result.size(),
+                                             existingRelation.size() - initialSize, move(plans[r].operators)});
+                plans[r].operators.clear();
+            }
+            if (asComponents && componentOutput)
+                writeHeading("SCC: R" + to_string(r) + "\n");
+            writeHeading(trimTrailingPeriod(rule.toString()) + "\n");
+            if (outputFormat == SUMMARY_OUTPUT)
+                output.write("  " + to_string(existingRelation.size() - initialSize) + " new\n");
             else
-                cout << "Yes(" << result.size() << ")\n" << result.toString();
+                writeRows(existingRelation, initialSize, rule.headPredicate.name);
+            if (explain) {
+                writeHeading(plans[r].explanation);
+                plans[r].explanation.clear();
+            }
+            if (asComponents && componentOutput)
+                writeHeading("1 passes: R" + to_string(r) + "\n");
         }
+        for (size_t k = 0; k < (parallel ? ruleIDs.size() : 1); k++)
+            arenas[k]->reset();
+        return databaseChanged;
     }
-    Relation evaluateQuery(const Predicate& query) {
-        Relation relation = database.getRelation(query.name);
-        vector<int> projectIndices;
-        vector<string> renameAttributes;
+    Relation evaluateRuleFrom(int ruleID, const vector<size_t>& marks) {
+        if (!semiNaive || marks.empty())
+            return evaluateRule(ruleID);
+        return evaluateRuleDelta(ruleID, marks);
+    }
+    vector<size_t> bodySizes(int ruleID) const {
+        vector<size_t> sizes;
+        for (const AtomPlan& atom : plans[ruleID].atoms)
+            sizes.push_back(storedRelation(atom.relationName).size());
+        return sizes;
+    }
+    const Relation& storedRelation(const string& name) const {
+        return database.getRelation(name);
+    }
+    // Builds the indexes and column statistics the rules are about to ask
+    // for, so that evaluating them in parallel only reads shared relations.
+    void prepareForParallel(const vector<int>& ruleIDs) const {
+        for (int r : ruleIDs) {
+            if (!plans[r].valid)
+                continue;
+            for (const AtomPlan& atom : plans[r].atoms) {
+                const Relation& stored = storedRelation(atom.relationName);
+                if (!atom.constantColumns.empty() && atom.satisfiable && stored.getScheme().size() == atom.arity)
+                    stored.indexOn(atom.constantColumns);
+                if (reorderJoins)
+                    for (int column : atom.projectColumns)
+                        stored.distinctCount(column);
+            }
+        }
+    }
+    static string ruleNames(const vector<int>& ruleIDs) {
+        stringstream ss;
+        for (size_t i = 0; i < ruleIDs.size(); i++) {
+            if (i > 0)
+                ss << ",";
+            ss << "R" << ruleIDs[i];
+        }
+        return ss.str();
+    }
+    // Turns every rule into a RulePlan. Problems with a rule's schemes are
+    // reported here, once, and the rule then derives nothing.
+    void compileRules() {
+        plans.clear();
+        for (const Rule& rule : datalogProgram.rules)
+            plans.push_back(compileRule(rule));
+    }
+    RulePlan compileRule(const Rule& rule) {
+        RulePlan plan;
+        plan.valid = true;
+        plan.headName = rule.headPredicate.name;
+        auto report = [&](const string& problem) {
+            cerr << "In rule " << trimTrailingPeriod(rule.toString()) << ": " << problem << endl;
+            plan.valid = false;
+        };
+        set<string> bodyVariables;
+        for (const Predicate& predicate : rule.bodyPredicates) {
+            if (!database.hasRelation(predicate.name))
+                report("no scheme named " + predicate.name);
+            else if (database.getRelation(predicate.name).getScheme().size() != predicate.parameters.size())
+                report("wrong number of attributes for " + predicate.name);
+            plan.atoms.push_back(compileAtom(predicate, true));
+            bodyVariables.insert(plan.atoms.back().scheme.begin(), plan.atoms.back().scheme.end());
+        }
+        if (!database.hasRelation(plan.headName)) {
+            report("no scheme named " + plan.headName);
+            return plan;
+        }
+        plan.headScheme = database.getRelation(plan.headName).getScheme();
+        if (plan.headScheme.size() != rule.headPredicate.parameters.size())
+            report("mismatch in number of attributes between rule head and target scheme");
+        for (const Parameter& param : rule.headPredicate.parameters) {
+            if (!bodyVariables.count(param.value))
+                report("head attribute " + param.value + " does not occur in the body");
+            plan.headVariables.push_back(param.value);
+        }
+        if (!plan.valid)
+            return plan;
+        vector<int> atomOrder;
+        for (size_t i = 0; i < plan.atoms.size(); i++)
+            atomOrder.push_back(i);
+        plan.sourceOrder = makeJoinOrder(plan, atomOrder);
+        plan.orders.resize(plan.atoms.size() + 1);
+        return plan;
+    }
+    static JoinOrder makeJoinOrder(const RulePlan& plan, const vector<int>& atomOrder) {
+        JoinOrder order;
+        order.atoms = atomOrder;
+        Scheme joined = plan.atoms[atomOrder[0]].scheme;
+        for (size_t k = 1; k < atomOrder.size(); k++) {
+            order.joins.push_back(Relation::joinColumns(joined, plan.atoms[atomOrder[k]].scheme));
+            joined = order.joins.back().scheme;
+        }
+        for (const string& variable : plan.headVariables)
+            order.headColumns.push_back(distance(joined.begin(), find(joined.begin(), joined.end(), variable)));
+        return order;
+    }
+    // Rule constants are interned so that tuples added later can match
+    // them; ad-hoc queries only look theirs up.
+    static AtomPlan compileAtom(const Predicate& predicate, bool internConstants) {
+        AtomPlan atom;
+        atom.relationName = predicate.name;
+        atom.arity = predicate.parameters.size();
+        atom.satisfiable = true;
         map<string, int> variableIndices;
-        for (size_t i = 0; i < query.parameters.size(); i++) {
-            const auto& param = query.parameters[i];
-            if (!param.value.empty() && param.value.front() == '\'')
-                relation = relation.select(i, param.value);
+        for (size_t i = 0; i < predicate.parameters.size(); i++) {
+            const string& value = predicate.parameters[i].value;
+            if (!value.empty() && value.front() == '\'') {
+                Symbol id = 0;
+                if (internConstants)
+                    id = SymbolTable::global().intern(value);
+                else if (!SymbolTable::global().lookup(value, id))
+                    atom.satisfiable = false;
+                atom.constantColumns.push_back(i);
+                atom.constantValues.push_back(id);
+            } else if (variableIndices.count(value))
+                atom.equalColumns.push_back({variableIndices[value], static_cast<int>(i)});
             else {
-                if (variableIndices.find(param.value) != variableIndices.end())
-                    relation = relation.select(variableIndices[param.value], i);
-                else {
-                    variableIndices[param.value] = i;
-                    projectIndices.push_back(i);
-                    renameAttributes.push_back(param.value);
+                variableIndices[value] = i;
+                atom.projectColumns.push_back(i);
+                atom.scheme.push_back(value);
+            }
+        }
+        return atom;
+    }
+    // Constant filters, equality filters and the projection onto the atom's
+    // variables in one pass over the source rows from 'firstRow' on, so only
+    // the result is materialized. The projected rows are distinct without
+    // a check: the columns dropped hold constants or repeat a kept column.
+    // With 'operators', the scan's row counts and time are appended to it.
+    static Relation runAtom(const AtomPlan& atom, const Relation& source,
+                            vector<Profiler::Operator>* operators = nullptr, size_t firstRow = 0) {
+        if (!atom.satisfiable || source.getScheme().size() != atom.arity)
+            return Relation(atom.relationName, atom.scheme);
+        auto start = operators ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+        bool identity = firstRow == 0 && atom.constantColumns.empty() && atom.equalColumns.empty();
+        for (size_t i = 0; i < atom.projectColumns.size() && identity; i++)
+            identity = atom.projectColumns[i] == static_cast<int>(i);
+        Relation result = identity ? source.rename(atom.scheme)
+                                   : Relation(atom.relationName, atom.scheme, Relation::scratchResource());
+        if (!identity) {
+            vector<Symbol> projected(atom.projectColumns.size());
+            auto emit = [&](const Symbol* row) {
+                for (const auto& columns : atom.equalColumns)
+                    if (row[columns.first] != row[columns.second])
+                        return true;
+                for (size_t i = 0; i < projected.size(); i++)
+                    projected[i] = row[atom.projectColumns[i]];
+                result.appendDistinctRow(projected.data());
+                return true;
+            };
+            if (firstRow == 0 && !atom.constantColumns.empty()) {
+                // All constants go through one composite index lookup.
+                source.forEachMatching(atom.constantColumns, atom.constantValues.data(), emit);
+            } else {
+                for (size_t r = firstRow; r < source.size(); r++) {
+                    const Symbol* row = source.row(r);
+                    bool matches = true;
+                    for (size_t k = 0; k < atom.constantColumns.size() && matches; k++)
+                        matches = row[atom.constantColumns[k]] == atom.constantValues[k];
+                    if (matches)
+                        emit(row);
                 }
             }
         }
-        relation = relation.project(projectIndices);
-        relation = relation.rename(renameAttributes);
-        return relation;
+        if (operators)
+            operators->push_back({"scan", atom.relationName, source.size() - min(firstRow, source.size()), 0,
+                                  result.size(), Profiler::secondsSince(start)});
+        return result;
+    }
+    // Whether the atom reads all of 'source' as it is, with only its
+    // attributes renamed.
+    static bool readsWhole(const AtomPlan& atom, const Relation& source, size_t firstRow = 0) {
+        if (!atom.satisfiable || firstRow != 0 || source.getScheme().size() != atom.arity ||
+            !atom.constantColumns.empty() || !atom.equalColumns.empty())
+            return false;
+        for (size_t i = 0; i < atom.projectColumns.size(); i++)
+            if (atom.projectColumns[i] != static_cast<int>(i))
+                return false;
+        return true;
+    }
+    // The atom's rows: 'source' itself when it reads all of it, with the
+    // atom's scheme as the view of its columns, or else the result of
+    // runAtom() appended to 'results', which must not reallocate.
+    static const Relation* scanAtom(const AtomPlan& atom, const Relation& source, vector<Relation>& results,
+                                    vector<Profiler::Operator>* operators = nullptr, size_t firstRow = 0) {
+        if (readsWhole(atom, source, firstRow)) {
+            if (operators)
+                operators->push_back({"scan", atom.relationName, source.size(), 0, source.size(), 0});
+            return &source;
+        }
+        results.push_back(runAtom(atom, source, operators, firstRow));
+        return &results.back();
+    }
+    vector<Profiler::Operator>* profiled(RulePlan& plan) const {
+        return profiler ? &plan.operators : nullptr;
+    }
+    Relation evaluateRule(size_t ruleID) {
+        RulePlan& plan = plans[ruleID];
+        if (!plan.valid)
+            return Relation(plan.headName, plan.headScheme);
+        // Reserved, since a reallocation would copy the results out of the
+        // scratch resource.
+        vector<Relation> atomResults;
+        atomResults.reserve(plan.atoms.size());
+        vector<const Relation*> inputs;
+        for (const AtomPlan& atom : plan.atoms)
+            inputs.push_back(scanAtom(atom, storedRelation(atom.relationName), atomResults, profiled(plan)));
+        return joinAtoms(ruleID, inputs, 0);
+    }
+    // Semi-naive step: one variant of the rule per body atom whose relation
+    // grew since 'marks', with that atom reading only the new tuples. The
+    // full result of an atom is computed only once a variant of another
+    // atom joins it and is shared by the later variants, so an atom that
+    // only its own variant reads is never scanned in full.
+    Relation evaluateRuleDelta(size_t ruleID, const vector<size_t>& marks) {
+        RulePlan& plan = plans[ruleID];
+        Relation result(plan.headName, plan.headScheme, Relation::scratchResource());
+        if (!plan.valid)
+            return result;
+        // Reserved, since a reallocation would move the results the inputs
+        // point at. Atoms that read a whole relation point at it instead.
+        vector<Relation> fullResults;
+        fullResults.reserve(plan.atoms.size());
+        vector<const Relation*> full(plan.atoms.size(), nullptr);
+        for (size_t i = 0; i < plan.atoms.size(); i++) {
+            const Relation& source = storedRelation(plan.atoms[i].relationName);
+            if (source.size() == marks[i])
+                continue;
+            vector<Relation> deltaResult;
+            deltaResult.reserve(1);
+            const Relation* delta = scanAtom(plan.atoms[i], source, deltaResult, profiled(plan), marks[i]);
+            vector<const Relation*> inputs(plan.atoms.size());
+            for (size_t j = 0; j < plan.atoms.size(); j++) {
+                if (j != i && !full[j]) {
+                    const AtomPlan& atom = plan.atoms[j];
+                    full[j] = scanAtom(atom, storedRelation(atom.relationName), fullResults, profiled(plan));
+                }
+                inputs[j] = j == i ? delta : full[j];
+            }
+            result.unionWith(joinAtoms(ruleID, inputs, i + 1));
+        }
+        return result;
+    }
+    Relation joinAtoms(size_t ruleID, const vector<const Relation*>& atomResults, size_t variant) {
+        RulePlan& plan = plans[ruleID];
+        const JoinOrder& order = reorderJoins ? costBasedOrder(plan, atomResults, variant) : plan.sourceOrder;
+        // The inputs may be stored relations, which are only read, so the
+        // first join makes the first copy. Joins go by column number, so the
+        // schemes of the inputs do not matter.
+        const Relation* joined = atomResults[order.atoms[0]];
+        Relation result(plan.headName, plan.headScheme, Relation::scratchResource());
+        vector<size_t> actualSizes(1, joined->size());
+        for (size_t k = 1; k < order.atoms.size() && joined->size() > 0; k++) {
+            auto start = profiler ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+            const Relation& right = *atomResults[order.atoms[k]];
+            size_t leftRows = joined->size();
+            result = joined->joinOn(right, order.joins[k - 1]);
+            joined = &result;
+            actualSizes.push_back(result.size());
+            if (profiler)
+                plan.operators.push_back({"join", plan.atoms[order.atoms[k]].relationName, leftRows, right.size(),
+                                          result.size(), Profiler::secondsSince(start)});
+        }
+        if (explain)
+            explainOrder(ruleID, order, variant, actualSizes);
+        if (actualSizes.size() < order.atoms.size())
+            return Relation(plan.headName, plan.headScheme);
+        auto start = profiler ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+        Relation head = joined->project(order.headColumns, plan.headScheme);
+        if (profiler)
+            plan.operators.push_back({"project", plan.headName, joined->size(), 0, head.size(),
+                                      Profiler::secondsSince(start)});
+        return head;
+    }
+    // Greedy cost-based join order over the already filtered atom results:
+    // start from the smallest, then keep adding the connected atom with the
+    // smallest estimated join, and only fall back to a cross product when
+    // nothing left is connected. Estimates use per-column distinct counts.
+    const JoinOrder& costBasedOrder(RulePlan& plan, const vector<const Relation*>& atomResults, size_t variant) {
+        JoinOrder& cached = plan.orders[variant];
+        vector<size_t> sizes;
+        for (const Relation* atomResult : atomResults)
+            sizes.push_back(atomResult->size());
+        if (!cached.atoms.empty() && !statisticsDrifted(cached.plannedSizes, sizes))
+            return cached;
+        // Distinct values per variable of each atom, capped by its size.
+        vector<map<string, double>> distinct(plan.atoms.size());
+        for (size_t i = 0; i < plan.atoms.size(); i++) {
+            const AtomPlan& atom = plan.atoms[i];
+            const Relation& stored = storedRelation(atom.relationName);
+            for (size_t v = 0; v < atom.scheme.size(); v++)
+                distinct[i][atom.scheme[v]] = max(1.0, min<double>(stored.distinctCount(atom.projectColumns[v]), sizes[i]));
+        }
+        vector<bool> used(plan.atoms.size(), false);
+        vector<int> atomOrder;
+        vector<double> estimates;
+        map<string, double> joinedDistinct;
+        double joinedSize = 0;
+        for (size_t step = 0; step < plan.atoms.size(); step++) {
+            int best = -1;
+            bool bestConnected = false;
+            double bestSize = 0;
+            for (size_t i = 0; i < plan.atoms.size(); i++) {
+                if (used[i])
+                    continue;
+                bool connected = step == 0;
+                double estimate = step == 0 ? sizes[i] : joinedSize * sizes[i];
+                for (const auto& variable : distinct[i]) {
+                    auto shared = joinedDistinct.find(variable.first);
+                    if (step == 0 || shared == joinedDistinct.end())
+                        continue;
+                    connected = true;
+                    estimate /= max(shared->second, variable.second);
+                }
+                if (best < 0 || (connected && !bestConnected) ||
+                    (connected == bestConnected && estimate < bestSize)) {
+                    best = i;
+                    bestConnected = connected;
+                    bestSize = estimate;
+                }
+            }
+            used[best] = true;
+            atomOrder.push_back(best);
+            joinedSize = bestSize;
+            estimates.push_back(bestSize);
+            for (const auto& variable : distinct[best]) {
+                auto shared = joinedDistinct.find(variable.first);
+                joinedDistinct[variable.first] = shared == joinedDistinct.end() ?
+                    variable.second : min(shared->second, variable.second);
+            }
+            for (auto& variable : joinedDistinct)
+                variable.second = max(1.0, min(variable.second, joinedSize));
+        }
+        cached = makeJoinOrder(plan, atomOrder);
+        cached.estimates = estimates;
+        cached.plannedSizes = sizes;
+        return cached;
+    }
+    // An order is re-planned once any atom has more than doubled or halved,
+    // ignoring small absolute changes.
+    static bool statisticsDrifted(const vector<size_t>& planned, const vector<size_t>& actual) {
+        for (size_t i = 0; i < planned.size(); i++)
+            if (actual[i] > 2 * planned[i] + 16 || planned[i] > 2 * actual[i] + 16)
+                return true;
+        return false;
+    }
+    void explainOrder(size_t ruleID, const JoinOrder& order, size_t variant, const vector<size_t>& actualSizes) {
+        const Rule& rule = datalogProgram.rules[ruleID];
+        stringstream explanation;
+        explanation << "  explain R" << ruleID;
+        if (variant > 0)
+            explanation << " (delta of " << rule.bodyPredicates[variant - 1].toString() << ")";
+        explanation << ":";
+        for (size_t k = 0; k < order.atoms.size(); k++) {
+            explanation << (k == 0 ? " " : " -> ") << rule.bodyPredicates[order.atoms[k]].toString() << " [est ";
+            if (k < order.estimates.size())
+                explanation << static_cast<size_t>(order.estimates[k] + 0.5);
+            else
+                explanation << "-";
+            explanation << ", actual ";
+            if (k < actualSizes.size())
+                explanation << actualSizes[k];
+            else
+                explanation << "-";
+            explanation << "]";
+        }
+        explanation << "\n";
+        plans[ruleID].explanation += explanation.str();
+    }
+    // A query with the wrong number of attributes for its relation is
+    // reported the way compileRule() reports a rule, and not answered.
+    void evaluateQueries() {
+        Profiler::Timer timer(profiler, "query");
+        writeHeading("\nQuery Evaluation\n");
+        for (size_t q = 0; q < datalogProgram.queries.size(); q++) {
+            const Predicate& query = datalogProgram.queries[q];
+            const string& source = q < querySources.size() ? querySources[q] : query.name;
+            string text = trimTrailingPeriod(query.toString());
+            if (database.hasRelation(query.name) &&
+                database.getRelation(query.name).getScheme().size() != query.parameters.size()) {
+                cerr << "In query " << text << ": wrong number of attributes for " << query.name << endl;
+                continue;
+            }
+            AtomPlan atom = compileAtom(query, false);
+            vector<Relation> materialized;
+            materialized.reserve(1);
+            const Relation* result = scanAtom(atom, storedRelation(source), materialized);
+            if (outputFormat != TSV_OUTPUT)
+                output.write(answerHeading(text, *result));
+            if (outputFormat != SUMMARY_OUTPUT)
+                writeRows(*result, atom.scheme, 0, text);
+        }
+        output.flush();
+    }
+    static string formatAnswer(const Predicate& query, const Relation& result) {
+        return formatAnswer(query, result, result.getScheme());
+    }
+    // The same, with the rows under the attribute names of 'scheme'.
+    static string formatAnswer(const Predicate& query, const Relation& result, const Scheme& scheme) {
+        return answerHeading(trimTrailingPeriod(query.toString()), result) + result.toString(scheme);
+    }
+    static string answerHeading(const string& query, const Relation& result) {
+        if (result.size() == 0)
+            return query + "? No\n";
+        return query + "? Yes(" + to_string(result.size()) + ")\n";
+    }
+    // Headings, rules and explanations, which TSV output leaves out.
+    void writeHeading(const string& text) {
+        if (outputFormat != TSV_OUTPUT)
+            output.write(text);
+    }
+    // Writes the rows of 'relation' from 'firstRow' on in output order,
+    // labelled with 'label' as TSV. In the background the rows are copied
+    // first, since the relation keeps changing.
+    void writeRows(const Relation& relation, size_t firstRow, const string& label) {
+        writeRows(relation, relation.getScheme(), firstRow, label);
+    }
+    // The same, with the rows under the attribute names of 'scheme'.
+    void writeRows(const Relation& relation, const Scheme& scheme, size_t firstRow, const string& label) {
+        size_t count = relation.size() - firstRow;
+        if (count == 0)
+            return;
+        size_t arity = scheme.size();
+        const Symbol* rows = relation.row(firstRow);
+        OutputFormat format = outputFormat;
+        if (!output.inBackground()) {
+            output.submit([&](OutputBuffer& out) { formatRows(out, rows, count, scheme, format, label); });
+            return;
+        }
+        output.submit([copy = vector<Symbol>(rows, rows + count * arity), count, scheme,
+                       format, label](OutputBuffer& out) { formatRows(out, copy.data(), count, scheme, format, label); });
+    }
+    static void formatRows(OutputBuffer& out, const Symbol* rows, size_t count, const Scheme& scheme,
+                           OutputFormat format, const string& label) {
+        size_t arity = scheme.size();
+        for (size_t r : Relation::sortedRows(rows, count, arity)) {
+            TupleRef tuple(rows + r * arity, arity);
+            if (format == TSV_OUTPUT) {
+                out.append(label);
+                if (arity > 0)
+                    out.push_back('\t');
+                tuple.appendTsv(out);
+            } else {
+                out.append("  ", 2);
+                tuple.appendTo(out, scheme);
+            }
+            out.push_back('\n');
+        }
+    }
+    const Database& getDatabase() const {
+        return database;
+    }
+    Relation evaluateQuery(const Predicate& query) {
+        return evaluateQuery(query, database.getRelation(query.name));
+    }
+    Relation evaluateQuery(const Predicate& query, const Relation& source) {
+        return runAtom(compileAtom(query, false), source);
     }
     void interpret() {
-        evaluateSchemes();
-        evaluateFacts();
+        if (evaluated) {
+            evaluateQueries();
+            return;
+        }
+        loadProgram();
+        if (demandDriven)
+            rewriteForQueries();
+        compileRules();
+        for (const RulePlan& plan : plans)
+            if (plan.valid && !baseFacts.count(plan.headName))
+                baseFacts.emplace(plan.headName, database.getRelation(plan.headName));
         evaluateRules();
+        evaluated = true;
         evaluateQueries();
     }
+    // Before evaluation an update only changes the facts. A database
+    // loaded from a snapshot has no record of which tuples of a derived
+    // relation were given, so all of them count as derived.
+    void prepareUpdate() {
+        if (!evaluated) {
+            loadProgram();
+            return;
+        }
+        if (plans.size() != datalogProgram.rules.size())
+            compileRules();
+        for (const RulePlan& plan : plans)
+            if (plan.valid && !baseFacts.count(plan.headName))
+                baseFacts.emplace(plan.headName, Relation(plan.headName, plan.headScheme));
+        if (bindings.size() == plans.size())
+            return;
+        bindings.clear();
+        for (const RulePlan& plan : plans) {
+            RuleBindings rule;
+            map<string, int> variables;
+            auto variable = [&](const string& name) {
+                auto it = variables.find(name);
+                if (it != variables.end())
+                    return it->second;
+                int id = variables.size();
+                variables[name] = id;
+                return id;
+            };
+            for (const AtomPlan& atom : plan.atoms) {
+                rule.atomVariables.emplace_back();
+                for (const string& name : atom.scheme)
+                    rule.atomVariables.back().push_back(variable(name));
+            }
+            for (const string& name : plan.headVariables)
+                rule.headVariables.push_back(variable(name));
+            rule.variableCount = variables.size();
+            bindings.push_back(rule);
+        }
+    }
+    Relation& deltaFor(map<string, Relation>& delta, const string& name) {
+        auto it = delta.find(name);
+        if (it == delta.end()) {
+            const Relation& stored = database.getRelation(name);
+            it = delta.emplace(name, Relation(name, stored.getScheme())).first;
+        }
+        return it->second;
+    }
+    // Adds what the rules derive from 'delta', round by round, until a
+    // round derives nothing new.
+    void propagateInserts(map<string, Relation> delta) {
+        while (!delta.empty()) {
+            map<string, Relation> next;
+            forEachConsequence(delta, [&](const RulePlan& plan, const Tuple& head) {
+                if (!database.getRelation(plan.headName).contains(head))
+                    deltaFor(next, plan.headName).addTuple(head);
+            });
+            for (const auto& entry : next)
+                database.getRelation(entry.first).unionWith(entry.second);
+            delta = move(next);
+        }
+    }
+    // Calls f(plan, head tuple) for every rule instance that uses at least
+    // one tuple of 'delta', with the other atoms read from the database.
+    template <typename F>
+    void forEachConsequence(const map<string, Relation>& delta, F f) {
+        for (size_t r = 0; r < plans.size(); r++) {
+            const RulePlan& plan = plans[r];
+            if (!plan.valid)
+                continue;
+            for (size_t i = 0; i < plan.atoms.size(); i++) {
+                auto changed = delta.find(plan.atoms[i].relationName);
+                if (changed == delta.end())
+                    continue;
+                for (TupleRef tuple : changed->second.getTuples())
+                    deriveFrom(r, i, tuple.begin(), [&](const Tuple& head) {
+                        f(plan, head);
+                        return true;
+                    });
+            }
+        }
+    }
+    // Runs rule 'ruleID' with body atom 'seed' matched to 'row' only.
+    template <typename F>
+    bool deriveFrom(size_t ruleID, size_t seed, const Symbol* row, F emit) {
+        const RulePlan& plan = plans[ruleID];
+        const AtomPlan& atom = plan.atoms[seed];
+        if (!atom.satisfiable)
+            return true;
+        for (size_t k = 0; k < atom.constantColumns.size(); k++)
+            if (row[atom.constantColumns[k]] != atom.constantValues[k])
+                return true;
+        for (const auto& columns : atom.equalColumns)
+            if (row[columns.first] != row[columns.second])
+                return true;
+        const RuleBindings& rule = bindings[ruleID];
+        vector<Symbol> values(rule.variableCount);
+        vector<bool> bound(rule.variableCount, false);
+        for (size_t k = 0; k < atom.projectColumns.size(); k++) {
+            values[rule.atomVariables[seed][k]] = row[atom.projectColumns[k]];
+            bound[rule.atomVariables[seed][k]] = true;
+        }
+        vector<bool> done(plan.atoms.size(), false);
+        done[seed] = true;
+        return probeAtoms(ruleID, done, plan.atoms.size() - 1, values, bound, emit);
+    }
+    // Whether some rule derives 'tuple' into 'name' from the database as
+    // it stands.
+    bool derivable(const string& name, const TupleRef& tuple) {
+        for (size_t r = 0; r < plans.size(); r++) {
+            const RulePlan& plan = plans[r];
+            if (!plan.valid || plan.headName != name)
+                continue;
+            const RuleBindings& rule = bindings[r];
+            vector<Symbol> values(rule.variableCount);
+            vector<bool> bound(rule.variableCount, false);
+            bool consistent = true;
+            for (size_t k = 0; k < rule.headVariables.size() && consistent; k++) {
+                int variable = rule.headVariables[k];
+                consistent = !bound[variable] || values[variable] == tuple[k];
+                values[variable] = tuple[k];
+                bound[variable] = true;
+            }
+            vector<bool> done(plan.atoms.size(), false);
+            auto found = [](const Tuple&) { return false; };
+            if (consistent && !probeAtoms(r, done, plan.atoms.size(), values, bound, found))
+                return true;
+        }
+        return false;
+    }
+    // Joins the atoms not yet done one at a time, always probing next the
+    // one with the most columns already bound, and emits each head tuple.
+    // Returns false as soon as emit does.
+    template <typename F>
+    bool probeAtoms(size_t ruleID, vector<bool>& done, size_t remaining, vector<Symbol>& values,
+                    vector<bool>& bound, F& emit) {
+        const RulePlan& plan = plans[ruleID];
+        const RuleBindings& rule = bindings[ruleID];
+        if (remaining == 0) {
+            Tuple head;
+            for (int variable : rule.headVariables)
+                head.push_back(values[variable]);
+            return emit(head);
+        }
+        size_t best = 0;
+        int bestBound = -1;
+        for (size_t i = 0; i < plan.atoms.size(); i++) {
+            if (done[i])
+                continue;
+            int boundColumns = plan.atoms[i].constantColumns.size();
+            for (int variable : rule.atomVariables[i])
+                boundColumns += bound[variable];
+            if (boundColumns > bestBound) {
+                best = i;
+                bestBound = boundColumns;
+            }
+        }
+        const AtomPlan& atom = plan.atoms[best];
+        if (!atom.satisfiable)
+            return true;
+        vector<pair<int, Symbol>> keyColumns;
+        for (size_t k = 0; k < atom.constantColumns.size(); k++)
+            keyColumns.push_back({atom.constantColumns[k], atom.constantValues[k]});
+        vector<int> freeVariables, freeColumns;
+        for (size_t k = 0; k < atom.projectColumns.size(); k++) {
+            int variable = rule.atomVariables[best][k];
+            if (bound[variable])
+                keyColumns.push_back({atom.projectColumns[k], values[variable]});
+            else {
+                freeVariables.push_back(variable);
+                freeColumns.push_back(atom.projectColumns[k]);
+            }
+        }
+        sort(keyColumns.begin(), keyColumns.end());
+        vector<int> columns;
+        vector<Symbol> key;
+        for (const auto& column : keyColumns) {
+            columns.push_back(column.first);
+            key.push_back(column.second);
+        }
+
+        const Relation& relation = storedRelation(atom.relationName);
+        if (columns.size() == atom.arity && atom.equalColumns.empty()) {
+            // Fully bound: a membership test, no index needed.
+            if (!relation.contains(TupleRef(key.data(), key.size())))
+                return true;
+            done[best] = true;
+            bool keepGoing = probeAtoms(ruleID, done, remaining - 1, values, bound, emit);
+            done[best] = false;
+            return keepGoing;
+        }
+        done[best] = true;
+        for (int variable : freeVariables)
+            bound[variable] = true;
+        bool keepGoing = relation.forEachMatching(columns, key.data(), [&](const Symbol* row) {
+            for (const auto& equal : atom.equalColumns)
+                if (row[equal.first] != row[equal.second])
+                    return true;
+            for (size_t k = 0; k < freeVariables.size(); k++)
+                values[freeVariables[k]] = row[freeColumns[k]];
+            return probeAtoms(ruleID, done, remaining - 1, values, bound, emit);
+        });
+        for (int variable : freeVariables)
+            bound[variable] = false;
+        done[best] = false;
+        return keepGoing;
+    }
     static Graph makeGraph(const vector<Rule>& rules) {
         Graph graph(rules.size());
         for (size_t i = 0; i < rules.size(); i++) {
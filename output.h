@@ -0,0 +1,170 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+
+// A fixed-size byte buffer in front of a stream. Appending copies into the
+// buffer and only touches the stream once the buffer is full, so formatting
+// many small pieces costs no allocation and few writes.
+class OutputBuffer {
+public:
+    OutputBuffer(std::ostream& out, size_t capacity) : out(out), capacity(capacity) {
+        data.reserve(capacity);
+    }
+    void append(const char* text, size_t length) {
+        if (data.size() + length > capacity) {
+            drain();
+            if (length > capacity) {
+                out.write(text, length);
+                return;
+            }
+        }
+        data.append(text, length);
+    }
+    void append(std::string_view text) {
+        append(text.data(), text.size());
+    }
+    void push_back(char c) {
+        if (data.size() == capacity)
+            drain();
+        data.push_back(c);
+    }
+    // Hands everything buffered to the stream.
+    void drain() {
+        out.write(data.data(), data.size());
+        data.clear();
+    }
+
+private:
+    std::ostream& out;
+    size_t capacity;
+    std::string data;
+};
+
+// Writes text and formatting jobs to a stream in the order they are given.
+// A job appends its output to the buffer itself, so that large results are
+// formatted straight into it. In the background, jobs run on a thread of
+// their own while the caller goes on; whatever they read must stay
+// unchanged until flush() returns. The caller's own text is gathered
+// between jobs and queued as one piece.
+class OutputWriter {
+public:
+    using Job = std::function<void(OutputBuffer&)>;
+
+    explicit OutputWriter(std::ostream& out, size_t bufferSize = 1 << 20)
+        : out(out), bufferSize(bufferSize), buffer(out, bufferSize), stopping(false), busy(false) {}
+    OutputWriter(const OutputWriter&) = delete;
+    OutputWriter& operator=(const OutputWriter&) = delete;
+    ~OutputWriter() {
+        setBackground(false);
+        buffer.drain();
+    }
+
+    void setBackground(bool enabled) {
+        if (enabled == worker.joinable())
+            return;
+        if (enabled) {
+            stopping = false;
+            worker = std::thread(&OutputWriter::run, this);
+            return;
+        }
+        queuePending();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_one();
+        worker.join();
+    }
+    bool inBackground() const {
+        return worker.joinable();
+    }
+    void write(std::string_view text) {
+        if (!inBackground()) {
+            buffer.append(text);
+            return;
+        }
+        pending.append(text.data(), text.size());
+        if (pending.size() >= bufferSize)
+            queuePending();
+    }
+    void submit(Job job) {
+        if (!inBackground()) {
+            job(buffer);
+            return;
+        }
+        queuePending();
+        enqueue(std::move(job));
+    }
+    // Returns once everything given so far is in the stream.
+    void flush() {
+        if (inBackground()) {
+            queuePending();
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return jobs.empty() && !busy; });
+            buffer.drain();
+        } else {
+            buffer.drain();
+        }
+        out.flush();
+    }
+
+private:
+    // Bounds the memory held by jobs waiting for the thread.
+    static const size_t maxQueued = 64;
+
+    std::ostream& out;
+    size_t bufferSize;
+    OutputBuffer buffer;        // written by the thread while it runs
+    std::string pending;        // text written since the last queued job
+    std::deque<Job> jobs;
+    std::mutex mutex;
+    std::condition_variable ready;      // a job was queued, or stopping
+    std::condition_variable changed;    // a job was taken or finished
+    std::thread worker;
+    bool stopping;
+    bool busy;
+
+    void queuePending() {
+        if (pending.empty())
+            return;
+        enqueue([text = std::move(pending)](OutputBuffer& out) { out.append(text); });
+        pending.clear();
+    }
+    void enqueue(Job job) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return jobs.size() < maxQueued; });
+            jobs.push_back(std::move(job));
+        }
+        ready.notify_one();
+    }
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            ready.wait(lock, [this] { return !jobs.empty() || stopping; });
+            if (jobs.empty())
+                return;
+            Job job = std::move(jobs.front());
+            jobs.pop_front();
+            busy = true;
+            lock.unlock();
+            changed.notify_all();
+            job(buffer);
+            lock.lock();
+            busy = false;
+            changed.notify_all();
+        }
+    }
+};
+
+#endif
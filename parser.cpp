@@ -4,6 +4,7 @@
 #include <string>
 #include <set>
 #include <sstream>
+#include <memory>
 #include "scanner.h" 
 
 using namespace std;
@@ -11,7 +12,7 @@ using namespace std;
 class Parameter {
 public:
     string value;
-    Parameter(string val) : value(val) {}
+    Parameter(string val) : value(move(val)) {}
     string toString() const {
         return value;
     }
@@ -21,9 +22,9 @@ class Predicate {
 public:
     string name;
     vector<Parameter> parameters;
-    Predicate(string n) : name(n) {}
+    Predicate(string n) : name(move(n)) {}
     void addParameter(Parameter p) {
-        parameters.push_back(p);
+        parameters.push_back(move(p));
     }
     string toString() const {
         stringstream ss;
@@ -41,9 +42,9 @@ class Rule {
 public:
     Predicate headPredicate;
     vector<Predicate> bodyPredicates;
-    Rule(Predicate hp) : headPredicate(hp) {}
+    Rule(Predicate hp) : headPredicate(move(hp)) {}
     void addBodyPredicate(Predicate p) {
-        bodyPredicates.push_back(p);
+        bodyPredicates.push_back(move(p));
     }
     string toString() const {
         stringstream ss;
@@ -66,19 +67,19 @@ public:
     set<string> domain;
 
     void addScheme(Predicate p) {
-        schemes.push_back(p);
+        schemes.push_back(move(p));
     }
     void addFact(Predicate p) {
-        facts.push_back(p);
         for (const auto& param : p.parameters) {
-            domain.insert(param.toString());
+            domain.insert(param.value);
         }
+        facts.push_back(move(p));
     }
     void addRule(Rule r) {
-        rules.push_back(r);
+        rules.push_back(move(r));
     }
     void addQuery(Predicate p) {
-        queries.push_back(p);
+        queries.push_back(move(p));
     }
     string toString() const {
         stringstream ss;
@@ -107,28 +108,51 @@ public:
     }
 };
 
+// Receives facts as they are parsed, instead of DatalogProgram::facts, so
+// that a large Facts section never has to be held in memory.
+class FactSink {
+public:
+    virtual ~FactSink() {}
+    // Called once the Schemes section is complete, before the first fact.
+    virtual void beginFacts(const DatalogProgram& /* program */) {}
+    virtual void addFact(const Predicate& fact) = 0;
+};
+
+// Pulls tokens from a TokenSource, which must outlive the parser. A token
+// vector is read through a borrowed TokenVectorSource.
 class Parser {
 public:
-    vector<Token> tokens;
+    unique_ptr<TokenVectorSource> vectorSource;
+    TokenSource& source;
     DatalogProgram datalogProgram;
-    size_t currentTokenIndex;
+    FactSink* factSink;
+
+    Parser(const vector<Token>& tokens)
+        : vectorSource(new TokenVectorSource(tokens)), source(*vectorSource), factSink(nullptr) {}
+    Parser(TokenSource& source) : source(source), factSink(nullptr) {}
 
-    Parser(const vector<Token>& tokens) : tokens(tokens), currentTokenIndex(0) {}
+    void setFactSink(FactSink* sink) {
+        factSink = sink;
+    }
+
+    const Token& current() {
+        return source.peek();
+    }
 
     void skipComments() {
-        while (tokens[currentTokenIndex].getTokenType() == COMMENT || 
-               tokens[currentTokenIndex].getTokenType() == UNDEFINED) {
-            currentTokenIndex++;
+        while (current().getTokenType() == COMMENT || 
+               current().getTokenType() == UNDEFINED) {
+            source.advance();
         }
     }
 
     void match(TokenType expectedType) {
         skipComments();
-        if (tokens[currentTokenIndex].getTokenType() == expectedType) {
-            currentTokenIndex++;
+        if (current().getTokenType() == expectedType) {
+            source.advance();
             skipComments();
         } else {
-            throw runtime_error(tokens[currentTokenIndex].toString());
+            throw runtime_error(current().toString());
         }
     }
 
@@ -144,6 +168,8 @@ public:
         schemeList();
         match(FACTS);
         match(COLON);
+        if (factSink)
+            factSink->beginFacts(datalogProgram);
         factList();
         match(RULES);
         match(COLON);
@@ -155,99 +181,97 @@ public:
         match(END);
     }
 
+    // The list productions loop rather than recurse, so the stack stays
+    // flat however many elements a section holds.
     void schemeList() {
-        if (tokens[currentTokenIndex].getTokenType() == FACTS) return;
-        scheme();
-        schemeList();
+        while (current().getTokenType() != FACTS)
+            scheme();
     }
 
     void factList() {
-        if (tokens[currentTokenIndex].getTokenType() == RULES) return;
-        fact();
-        factList();
+        while (current().getTokenType() != RULES)
+            fact();
     }
 
     void ruleList() {
-        if (tokens[currentTokenIndex].getTokenType() == QUERIES) return;
-        rule();
-        ruleList();
+        while (current().getTokenType() != QUERIES)
+            rule();
     }
 
     void queryList() {
-        if (tokens[currentTokenIndex].getTokenType() == END) return;
-        query();
-        queryList();
+        while (current().getTokenType() != END)
+            query();
     }
 
     void scheme() {
-        Predicate p(tokens[currentTokenIndex].getTokenValue());
+        Predicate p(current().getTokenValue());
         match(ID);
         match(LEFT_PAREN);
-        p.addParameter(Parameter(tokens[currentTokenIndex].getTokenValue()));
+        p.addParameter(Parameter(current().getTokenValue()));
         match(ID);
         idList(p);
         match(RIGHT_PAREN);
-        datalogProgram.addScheme(p);
+        datalogProgram.addScheme(move(p));
     }
 
     void fact() {
-        Predicate p(tokens[currentTokenIndex].getTokenValue());
+        Predicate p(current().getTokenValue());
         match(ID);
         match(LEFT_PAREN);
-        p.addParameter(Parameter(tokens[currentTokenIndex].getTokenValue()));
+        p.addParameter(Parameter(current().getTokenValue()));
         match(STRING);
         stringList(p);
         match(RIGHT_PAREN);
         match(PERIOD);
-        datalogProgram.addFact(p);
+        if (factSink)
+            factSink->addFact(p);
+        else
+            datalogProgram.addFact(move(p));
     }
 
     void rule() {
-        Predicate head = headPredicate();
-        Rule r(head);
+        Rule r(headPredicate());
         match(COLON_DASH);
-        Predicate p = predicate();
-        r.addBodyPredicate(p);
+        r.addBodyPredicate(predicate());
         predicateList(r);
         match(PERIOD);
-        datalogProgram.addRule(r);
+        datalogProgram.addRule(move(r));
     }
 
     void query() {
         Predicate p = predicate();
         match(Q_MARK);
-        datalogProgram.addQuery(p);
+        datalogProgram.addQuery(move(p));
     }
 
     void idList(Predicate &p) {
-        if (tokens[currentTokenIndex].getTokenType() == RIGHT_PAREN) return;
-        match(COMMA);
-        p.addParameter(Parameter(tokens[currentTokenIndex].getTokenValue()));
-        match(ID);
-        idList(p);
+        while (current().getTokenType() != RIGHT_PAREN) {
+            match(COMMA);
+            p.addParameter(Parameter(current().getTokenValue()));
+            match(ID);
+        }
     }
 
     void stringList(Predicate &p) {
-        if (tokens[currentTokenIndex].getTokenType() == RIGHT_PAREN) return;
-        match(COMMA);
-        p.addParameter(Parameter(tokens[currentTokenIndex].getTokenValue()));
-        match(STRING);
-        stringList(p);
+        while (current().getTokenType() != RIGHT_PAREN) {
+            match(COMMA);
+            p.addParameter(Parameter(current().getTokenValue()));
+            match(STRING);
+        }
     }
 
     void predicateList(Rule &r) {
-        if (tokens[currentTokenIndex].getTokenType() == PERIOD) return;
-        match(COMMA);
-        Predicate p = predicate();
-        r.addBodyPredicate(p);
-        predicateList(r);
+        while (current().getTokenType() != PERIOD) {
+            match(COMMA);
+            r.addBodyPredicate(predicate());
+        }
     }
 
     Predicate headPredicate() {
-        Predicate p(tokens[currentTokenIndex].getTokenValue());
+        Predicate p(current().getTokenValue());
         match(ID);
         match(LEFT_PAREN);
-        p.addParameter(Parameter(tokens[currentTokenIndex].getTokenValue()));
+        p.addParameter(Parameter(current().getTokenValue()));
         match(ID);
         idList(p);
         match(RIGHT_PAREN);
@@ -255,11 +279,11 @@ public:
     }
 
     Predicate predicate() {
-        Predicate p(tokens[currentTokenIndex].getTokenValue());
+        Predicate p(current().getTokenValue());
         match(ID);
         match(LEFT_PAREN);
-        p.addParameter(Parameter(tokens[currentTokenIndex].getTokenValue()));
-        if (tokens[currentTokenIndex].getTokenType() == STRING) {
+        p.addParameter(Parameter(current().getTokenValue()));
+        if (current().getTokenType() == STRING) {
             match(STRING);
         } else {
             match(ID);
@@ -270,16 +294,16 @@ public:
     }
 
     void parameterList(Predicate &p) {
-        if (tokens[currentTokenIndex].getTokenType() == RIGHT_PAREN) return;
-        match(COMMA);
-        if (tokens[currentTokenIndex].getTokenType() == STRING) {
-            p.addParameter(Parameter(tokens[currentTokenIndex].getTokenValue()));
-            match(STRING);
-        } else {
-            p.addParameter(Parameter(tokens[currentTokenIndex].getTokenValue()));
-            match(ID);
+        while (current().getTokenType() != RIGHT_PAREN) {
+            match(COMMA);
+            if (current().getTokenType() == STRING) {
+                p.addParameter(Parameter(current().getTokenValue()));
+                match(STRING);
+            } else {
+                p.addParameter(Parameter(current().getTokenValue()));
+                match(ID);
+            }
         }
-        parameterList(p);
     }
 };
 
@@ -0,0 +1,172 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Where evaluation time goes: totals per phase, and for every rule
+// evaluation in every fixpoint pass its time, output and the rows after
+// each operator. The interpreter records into one when it is given one and
+// does no profiling work at all otherwise.
+class Profiler {
+public:
+    struct Operator {
+        std::string kind;           // "scan", "join" or "project"
+        std::string detail;         // the relation scanned, joined or projected into
+        size_t inputRows;
+        size_t otherRows;           // right-hand rows of a join, else 0
+        size_t outputRows;
+        double seconds;
+    };
+    struct RuleEvaluation {
+        int rule;
+        std::string text;
+        std::string component;      // the SCC's rules, e.g. "R0,R1"
+        int pass;                   // 1-based pass within the component
+        double seconds;
+        size_t produced;            // tuples the rule produced this pass
+        size_t added;               // of those, how many were new
+        std::vector<Operator> operators;
+    };
+
+    // Adds the time from construction to destruction to a phase. Does
+    // nothing for a null profiler.
+    class Timer {
+    private:
+        Profiler* profiler;
+        std::string phase;
+        std::chrono::steady_clock::time_point start;
+    public:
+        Timer(Profiler* profiler, std::string phase) : profiler(profiler), phase(std::move(phase)) {
+            if (profiler)
+                start = std::chrono::steady_clock::now();
+        }
+        ~Timer() {
+            if (profiler)
+                profiler->addPhase(phase, secondsSince(start));
+        }
+    };
+
+    static double secondsSince(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void addPhase(const std::string& name, double seconds) {
+        for (auto& phase : phases)
+            if (phase.first == name) {
+                phase.second += seconds;
+                return;
+            }
+        phases.push_back({name, seconds});
+    }
+    void addRuleEvaluation(RuleEvaluation evaluation) {
+        evaluations.push_back(std::move(evaluation));
+    }
+    const std::vector<RuleEvaluation>& ruleEvaluations() const {
+        return evaluations;
+    }
+
+    std::string toJson() const {
+        std::stringstream json;
+        json << "{\n  \"phases\": {";
+        for (size_t i = 0; i < phases.size(); i++)
+            json << (i ? ", " : "") << "\"" << phases[i].first << "\": " << phases[i].second;
+        json << "},\n  \"rules\": [";
+        std::map<int, RuleEvaluation> totals;
+        for (size_t i = 0; i < evaluations.size(); i++) {
+            const RuleEvaluation& e = evaluations[i];
+            json << (i ? ",\n" : "\n") << "    {\"rule\": " << e.rule << ", \"text\": \"" << escape(e.text)
+                 << "\", \"component\": \"" << e.component << "\", \"pass\": " << e.pass
+                 << ", \"seconds\": " << e.seconds << ", \"produced\": " << e.produced
+                 << ", \"added\": " << e.added << ", \"operators\": [";
+            for (size_t k = 0; k < e.operators.size(); k++) {
+                const Operator& op = e.operators[k];
+                json << (k ? ", " : "") << "{\"op\": \"" << op.kind << "\", \"detail\": \"" << escape(op.detail)
+                     << "\", \"input\": " << op.inputRows;
+                if (op.kind == "join") {
+                    json << ", \"right\": " << op.otherRows << ", \"selectivity\": "
+                         << (op.inputRows && op.otherRows ? double(op.outputRows) / op.inputRows / op.otherRows : 0.0);
+                }
+                json << ", \"output\": " << op.outputRows << ", \"seconds\": " << op.seconds << "}";
+            }
+            json << "]}";
+            RuleEvaluation& total = totals[e.rule];
+            if (total.pass == 0)
+                total = RuleEvaluation{e.rule, e.text, e.component, 0, 0, 0, 0, {}};
+            total.pass++;
+            total.seconds += e.seconds;
+            total.produced += e.produced;
+            total.added += e.added;
+        }
+        json << "\n  ],\n  \"totals\": [";
+        bool first = true;
+        for (const auto& entry : totals) {
+            const RuleEvaluation& t = entry.second;
+            json << (first ? "\n" : ",\n") << "    {\"rule\": " << t.rule << ", \"text\": \"" << escape(t.text)
+                 << "\", \"evaluations\": " << t.pass << ", \"seconds\": " << t.seconds
+                 << ", \"produced\": " << t.produced << ", \"added\": " << t.added << "}";
+            first = false;
+        }
+        json << "\n  ]\n}\n";
+        return json.str();
+    }
+
+    // Folded stacks, one "frame;frame;... microseconds" line per stack, as
+    // read by flamegraph.pl and speedscope. Rules sit under the evaluate
+    // phase and their operators under them, summed over all passes.
+    std::string toFolded() const {
+        std::map<std::string, double> stacks;
+        double ruleSeconds = 0;
+        for (const RuleEvaluation& e : evaluations) {
+            std::string rule = "evaluate;" + e.component + ";R" + std::to_string(e.rule) + " " + e.text;
+            double operatorSeconds = 0;
+            for (const Operator& op : e.operators) {
+                stacks[rule + ";" + op.kind] += op.seconds;
+                operatorSeconds += op.seconds;
+            }
+            if (e.seconds > operatorSeconds)
+                stacks[rule] += e.seconds - operatorSeconds;
+            ruleSeconds += e.seconds;
+        }
+        for (const auto& phase : phases) {
+            double seconds = phase.second;
+            if (phase.first == "evaluate")
+                seconds -= ruleSeconds;
+            if (seconds > 0)
+                stacks[phase.first] += seconds;
+        }
+        std::stringstream folded;
+        for (const auto& stack : stacks) {
+            long long microseconds = static_cast<long long>(stack.second * 1e6 + 0.5);
+            if (microseconds > 0)
+                folded << stack.first << " " << microseconds << "\n";
+        }
+        return folded.str();
+    }
+
+private:
+    std::vector<std::pair<std::string, double>> phases;
+    std::vector<RuleEvaluation> evaluations;
+
+    static std::string escape(const std::string& text) {
+        std::string escaped;
+        for (char c : text) {
+            if (c == '"' || c == '\\')
+                escaped += '\\';
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char code[8];
+                std::snprintf(code, sizeof(code), "\\u%04x", c);
+                escaped += code;
+            } else
+                escaped += c;
+        }
+        return escaped;
+    }
+};
+
+#endif
@@ -1,11 +1,23 @@
 #include "scanner.h"
 #include <sstream>
 #include <cctype>
+#include <algorithm>
 #include <iostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && !defined(SCANNER_SCALAR)
+#define SCANNER_X86 1
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
-Token::Token(TokenType type, string value, int lineNumber)
+Token::Token(TokenType type, string_view value, int lineNumber)
     : type(type), value(value), lineNumber(lineNumber) {}
 
 TokenType Token::getTokenType() const {
@@ -13,11 +25,19 @@ TokenType Token::getTokenType() const {
 }
 
 string Token::getTokenValue() const {
+    return string(value);
+}
+
+string_view Token::getLexeme() const {
     return value;
 }
 
+int Token::getLineNumber() const {
+    return lineNumber;
+}
+
 string Token::toString() const {
-    return "(" + tokenTypeToString(type) + ",'" + value + "'," + to_string(lineNumber) + ")";
+    return "(" + tokenTypeToString(type) + ",'" + string(value) + "'," + to_string(lineNumber) + ")";
 }
 
 string Token::tokenTypeToString(TokenType type) const {
@@ -44,8 +64,248 @@ string Token::tokenTypeToString(TokenType type) const {
     }
 }
 
+MappedFile::MappedFile(const string& path) : data(nullptr), length(0) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("Could not open file: " + path);
+    struct stat info;
+    if (fstat(fd, &info) < 0) {
+        close(fd);
+        throw runtime_error("Could not stat file: " + path);
+    }
+    length = info.st_size;
+    if (length > 0) {
+        void* address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED) {
+            close(fd);
+            throw runtime_error("Could not map file: " + path);
+        }
+        madvise(address, length, MADV_SEQUENTIAL);
+        data = static_cast<const char*>(address);
+    }
+    close(fd);
+}
+
+MappedFile::MappedFile(MappedFile&& other) : data(other.data), length(other.length) {
+    other.data = nullptr;
+    other.length = 0;
+}
+
+MappedFile::~MappedFile() {
+    if (data)
+        munmap(const_cast<char*>(data), length);
+}
+
+string_view MappedFile::contents() const {
+    return string_view(data ? data : "", length);
+}
+
 Scanner::Scanner(const string& input)
-    : input(input), lineNumber(1) {}
+    : ownedInput(input), mapping(nullptr), input(ownedInput), lineNumber(1) {}
+
+Scanner::Scanner(string&& input)
+    : ownedInput(move(input)), mapping(nullptr), input(ownedInput), lineNumber(1) {}
+
+Scanner::Scanner(MappedFile&& file)
+    : mapping(new MappedFile(move(file))), input(mapping->contents()), lineNumber(1) {}
+
+// Runs that the lexer skips over in bulk. Each scan stops at the first
+// byte that ends the run and adds the newlines it passed to 'newlines'.
+enum RunKind {
+    STRING_BODY,    // up to the closing quote
+    COMMENT_BODY,   // up to the end of the line
+    BLANKS,         // over whitespace
+    WORD            // over letters, digits and '_'
+};
+
+static inline bool endsRun(RunKind kind, char c) {
+    switch (kind) {
+        case STRING_BODY: return c == '\'';
+        case COMMENT_BODY: return c == '\n';
+        case BLANKS: return !isspace(c);
+        default: return !(isalnum(c) || c == '_');
+    }
+}
+
+static size_t scanRunScalar(const char* data, size_t i, size_t end, RunKind kind, int& newlines) {
+    for (; i < end && !endsRun(kind, data[i]); i++) {
+        if (data[i] == '\n')
+            newlines++;
+    }
+    return i;
+}
+
+#ifdef SCANNER_X86
+// Both vector versions build, per block, a bit mask of the bytes that end
+// the run and one of the newlines, then finish the last partial block with
+// the scalar loop. Bytes outside ASCII compare as negative, so they are
+// neither blanks nor word characters, matching isspace/isalnum in the C locale.
+static inline __m128i inRange16(__m128i v, char low, char high) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(low - 1)),
+                         _mm_cmplt_epi8(v, _mm_set1_epi8(high + 1)));
+}
+
+static size_t scanRunSse2(const char* data, size_t i, size_t end, RunKind kind, int& newlines) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= end; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i stops;
+        switch (kind) {
+            case STRING_BODY: stops = _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')); break;
+            case COMMENT_BODY: stops = _mm_cmpeq_epi8(v, newline); break;
+            case BLANKS:
+                stops = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), inRange16(v, '\t', '\r'));
+                stops = _mm_xor_si128(stops, _mm_set1_epi8(-1));
+                break;
+            default:
+                stops = _mm_or_si128(_mm_or_si128(inRange16(v, 'a', 'z'), inRange16(v, 'A', 'Z')),
+                                     _mm_or_si128(inRange16(v, '0', '9'), _mm_cmpeq_epi8(v, _mm_set1_epi8('_'))));
+                stops = _mm_xor_si128(stops, _mm_set1_epi8(-1));
+        }
+        uint32_t stopMask = _mm_movemask_epi8(stops);
+        uint32_t newlineMask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+        if (stopMask) {
+            int offset = __builtin_ctz(stopMask);
+            newlines += __builtin_popcount(newlineMask & ((1u << offset) - 1));
+            return i + offset;
+        }
+        newlines += __builtin_popcount(newlineMask);
+    }
+    return scanRunScalar(data, i, end, kind, newlines);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i inRange32(__m256i v, char low, char high) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(low - 1)),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8(high + 1), v));
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t scanRunAvx2(const char* data, size_t i, size_t end, RunKind kind, int& newlines) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for (; i + 32 <= end; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i stops;
+        switch (kind) {
+            case STRING_BODY: stops = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')); break;
+            case COMMENT_BODY: stops = _mm256_cmpeq_epi8(v, newline); break;
+            case BLANKS:
+                stops = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), inRange32(v, '\t', '\r'));
+                stops = _mm256_xor_si256(stops, _mm256_set1_epi8(-1));
+                break;
+            default:
+                stops = _mm256_or_si256(_mm256_or_si256(inRange32(v, 'a', 'z'), inRange32(v, 'A', 'Z')),
+                                        _mm256_or_si256(inRange32(v, '0', '9'), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'))));
+                stops = _mm256_xor_si256(stops, _mm256_set1_epi8(-1));
+        }
+        uint32_t stopMask = _mm256_movemask_epi8(stops);
+        uint32_t newlineMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline));
+        if (stopMask) {
+            int offset = __builtin_ctz(stopMask);
+            newlines += __builtin_popcount(newlineMask & ((1u << offset) - 1));
+            return i + offset;
+        }
+        newlines += __builtin_popcount(newlineMask);
+    }
+    return scanRunScalar(data, i, end, kind, newlines);
+}
+#endif
+
+typedef size_t (*ScanRunFunction)(const char*, size_t, size_t, RunKind, int&);
+
+// Picks the widest version the CPU supports, once, at startup.
+static ScanRunFunction chooseScanRun() {
+#ifdef SCANNER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return scanRunAvx2;
+    return scanRunSse2;
+#else
+    return scanRunScalar;
+#endif
+}
+
+static const ScanRunFunction scanRunImpl = chooseScanRun();
+
+static inline size_t scanRun(string_view input, size_t i, RunKind kind, int& newlines) {
+    return scanRunImpl(input.data(), i, input.size(), kind, newlines);
+}
+
+bool Scanner::lexNext(string_view input, size_t& i, int& lineNumber, bool final, vector<Token>& tokens,
+                      ostream& warnings) {
+    char c = input[i];
+
+    if (isspace(c)) {
+        i = scanRun(input, i, BLANKS, lineNumber);
+    } else if (c == ',') {
+        tokens.push_back(Token(COMMA, ",", lineNumber));
+        i++;
+    } else if (c == '\'') {
+        int endLine = lineNumber;
+        size_t end = scanRun(input, i + 1, STRING_BODY, endLine);
+        if (end < input.size() && input[end] == '\'') {
+            end++;
+            tokens.push_back(Token(STRING, input.substr(i, end - i), lineNumber));
+        } else if (!final) {
+            return false;
+        } else {
+            tokens.push_back(Token(UNDEFINED, input.substr(i, end - i), lineNumber));
+            warnings << "Warning: Unterminated string starting on line " << lineNumber << endl;
+        }
+        i = end;
+        lineNumber = endLine;
+    } else if (c == '#') {
+        size_t end = scanRun(input, i, COMMENT_BODY, lineNumber);
+        if (end == input.size() && !final)
+            return false;
+        i = end;
+    } else if (isalpha(c)) {
+        int wordNewlines = 0;
+        size_t end = scanRun(input, i, WORD, wordNewlines);
+        if (end == input.size() && !final)
+            return false;
+        string_view value = input.substr(i, end - i);
+        TokenType type = (value == "Queries") ? QUERIES :
+                         (value == "Rules") ? RULES :
+                         (value == "Schemes") ? SCHEMES :
+                         (value == "Facts") ? FACTS :
+                         ID;
+        tokens.push_back(Token(type, value, lineNumber));
+        i = end;
+    } else if (c == ':') {
+        if (i + 1 == input.size() && !final)
+            return false;
+        if (i + 1 < input.size() && input[i + 1] == '-') {
+            tokens.push_back(Token(COLON_DASH, ":-", lineNumber));
+            i += 2;
+        } else {
+            tokens.push_back(Token(COLON, ":", lineNumber));
+            i++;
+        }
+    } else if (c == '(') {
+        tokens.push_back(Token(LEFT_PAREN, "(", lineNumber));
+        i++;
+    } else if (c == ')') {
+        tokens.push_back(Token(RIGHT_PAREN, ")", lineNumber));
+        i++;
+    } else if (c == '?') {
+        tokens.push_back(Token(Q_MARK, "?", lineNumber));
+        i++;
+    } else if (c == '.') {
+        tokens.push_back(Token(PERIOD, ".", lineNumber));
+        i++;
+    } else if (c == '+') {
+        tokens.push_back(Token(ADD, "+", lineNumber));
+        i++;
+    } else if (c == '*') {
+        tokens.push_back(Token(MULTIPLY, "*", lineNumber));
+        i++;
+    } else {
+        tokens.push_back(Token(UNDEFINED, input.substr(i, 1), lineNumber));
+        i++;
+    }
+    return true;
+}
 
 void Scanner::scan() {
     size_t i = 0;
@@ -55,82 +315,191 @@ void Scanner::scan() {
         return;
     }
 
-    while (i < input.size()) {
-        char c = input[i];
+    while (i < input.size())
+        lexNext(input, i, lineNumber, true, tokens, cerr);
 
-        if (isspace(c)) {
-            if (c == '\n') lineNumber++;
-            i++;
-        } else if (c == ',') {
-            tokens.push_back(Token(COMMA, ",", lineNumber));
-            i++;
-        } else if (c == '\'') {
-            size_t start = i;
-            int startLine = lineNumber;
-            i++;
-            while (i < input.size() && input[i] != '\'') {
-                if (input[i] == '\n') lineNumber++;
-                i++;
-            }
-            if (i < input.size() && input[i] == '\'') {
-                i++;
-                tokens.push_back(Token(STRING, input.substr(start, i - start), startLine));
-            } else {
-                tokens.push_back(Token(UNDEFINED, input.substr(start, i - start), startLine));
-                cerr << "Warning: Unterminated string starting on line " << startLine << endl;
-            }
-        } else if (c == '#') {
-            while (i < input.size() && input[i] != '\n') {
-                i++;
-            }
-        } else if (isalpha(c)) {
-            size_t start = i;
-            int startLine = lineNumber;
-            while (i < input.size() && (isalnum(input[i]) || input[i] == '_')) {
-                i++;
-            }
-            string value = input.substr(start, i - start);
-            TokenType type = (value == "Queries") ? QUERIES :
-                             (value == "Rules") ? RULES :
-                             (value == "Schemes") ? SCHEMES :
-                             (value == "Facts") ? FACTS :
-                             ID;
-            tokens.push_back(Token(type, value, startLine));
-        } else if (c == ':') {
-            if (i + 1 < input.size() && input[i + 1] == '-') {
-                tokens.push_back(Token(COLON_DASH, ":-", lineNumber));
-                i += 2;
-            } else {
-                tokens.push_back(Token(COLON, ":", lineNumber));
-                i++;
-            }
-        } else if (c == '(') {
-            tokens.push_back(Token(LEFT_PAREN, "(", lineNumber));
-            i++;
-        } else if (c == ')') {
-            tokens.push_back(Token(RIGHT_PAREN, ")", lineNumber));
-            i++;
-        } else if (c == '?') {
-            tokens.push_back(Token(Q_MARK, "?", lineNumber));
+    tokens.push_back(Token(END, "", lineNumber));
+}
+
+// Only strings carry lexer state from one line to the next: a comment ends
+// with its line, and every other token fits on one. Outside a string, '\''
+// always opens one and '#' always opens a comment, so this tracks the state
+// exactly without lexing. Returns whether 'text' ends inside a string.
+static bool endsInString(string_view text, bool inString) {
+    size_t i = 0;
+    int newlines = 0;
+    while (i < text.size()) {
+        if (inString) {
+            i = scanRun(text, i, STRING_BODY, newlines);
+            if (i == text.size())
+                return true;
+            inString = false;
             i++;
-        } else if (c == '.') {
-            tokens.push_back(Token(PERIOD, ".", lineNumber));
+        } else if (text[i] == '\'') {
+            inString = true;
             i++;
-        } else if (c == '+') {
-            tokens.push_back(Token(ADD, "+", lineNumber));
+        } else if (text[i] == '#') {
+            i = scanRun(text, i, COMMENT_BODY, newlines);
+        } else {
             i++;
-        } else if (c == '*') {
-            tokens.push_back(Token(MULTIPLY, "*", lineNumber));
+        }
+    }
+    return inString;
+}
+
+// Where the first line that starts outside a string begins, for text that
+// starts inside one, or text.size() if there is no such line.
+static size_t firstLineOutsideString(string_view text) {
+    int newlines = 0;
+    size_t i = scanRun(text, 0, STRING_BODY, newlines);
+    if (i < text.size())
+        i++;
+    while (i < text.size()) {
+        if (text[i] == '\'') {
+            i = scanRun(text, i + 1, STRING_BODY, newlines);
+            if (i == text.size())
+                break;
             i++;
+        } else if (text[i] == '#') {
+            i = scanRun(text, i, COMMENT_BODY, newlines);
+        } else if (text[i] == '\n') {
+            return i + 1;
         } else {
-            tokens.push_back(Token(UNDEFINED, string(1, c), lineNumber));
             i++;
         }
     }
+    return text.size();
+}
+
+void Scanner::scan(ThreadPool& pool, size_t minChunkSize) {
+    size_t chunkCount = min(pool.size() * 4, input.size() / max<size_t>(minChunkSize, 1));
+    if (pool.size() < 2 || chunkCount < 2) {
+        scan();
+        return;
+    }
 
+    // Cut roughly even chunks at line starts.
+    vector<size_t> starts(chunkCount + 1, input.size());
+    starts[0] = 0;
+    for (size_t c = 1; c < chunkCount; c++) {
+        size_t newline = input.find('\n', max(starts[c - 1], input.size() / chunkCount * c));
+        starts[c] = newline == string_view::npos ? input.size() : newline + 1;
+    }
+    auto chunk = [&](size_t begin, size_t end) { return input.substr(begin, end - begin); };
+
+    // Each chunk's end state for either start state, then a prefix pass
+    // gives the actual state at every chunk start.
+    vector<char> endStates(chunkCount * 2);
+    vector<size_t> newlines(chunkCount);
+    pool.parallelFor(chunkCount, [&](size_t c) {
+        string_view text = chunk(starts[c], starts[c + 1]);
+        endStates[c * 2] = endsInString(text, false);
+        endStates[c * 2 + 1] = endsInString(text, true);
+        newlines[c] = count(text.begin(), text.end(), '\n');
+    });
+    vector<char> startsInString(chunkCount);
+    vector<int> startLines(chunkCount);
+    bool inString = false;
+    int line = 1;
+    for (size_t c = 0; c < chunkCount; c++) {
+        startsInString[c] = inString;
+        startLines[c] = line;
+        inString = endStates[c * 2 + inString];
+        line += newlines[c];
+    }
+
+    // A chunk that starts inside a string leaves that string's lines to the
+    // chunk before it.
+    vector<size_t> begins(chunkCount + 1, input.size());
+    pool.parallelFor(chunkCount, [&](size_t c) {
+        begins[c] = starts[c];
+        if (startsInString[c]) {
+            string_view text = chunk(starts[c], starts[c + 1]);
+            size_t skipped = firstLineOutsideString(text);
+            begins[c] += skipped;
+            startLines[c] += count(text.begin(), text.begin() + skipped, '\n');
+        }
+    });
+    // A chunk with no such line is all string; the chunk before takes it whole.
+    for (size_t c = chunkCount; c-- > 0;) {
+        if (begins[c] == starts[c + 1])
+            begins[c] = begins[c + 1];
+    }
+
+    vector<vector<Token>> chunkTokens(chunkCount);
+    vector<ostringstream> chunkWarnings(chunkCount);
+    vector<int> endLines(chunkCount);
+    pool.parallelFor(chunkCount, [&](size_t c) {
+        string_view text = chunk(begins[c], begins[c + 1]);
+        chunkTokens[c].reserve(text.size() / 4);
+        int lineNumber = startLines[c];
+        size_t i = 0;
+        while (i < text.size())
+            lexNext(text, i, lineNumber, true, chunkTokens[c], chunkWarnings[c]);
+        endLines[c] = lineNumber;
+    });
+
+    size_t total = 1;
+    for (const auto& part : chunkTokens)
+        total += part.size();
+    tokens.reserve(tokens.size() + total);
+    for (size_t c = 0; c < chunkCount; c++) {
+        tokens.insert(tokens.end(), chunkTokens[c].begin(), chunkTokens[c].end());
+        cerr << chunkWarnings[c].str() << flush;
+    }
+    lineNumber = endLines[chunkCount - 1];
     tokens.push_back(Token(END, "", lineNumber));
 }
 
 const vector<Token>& Scanner::getTokens() const {
     return tokens;
 }
+
+
+TokenVectorSource::TokenVectorSource(const vector<Token>& tokens) : tokens(tokens), index(0) {}
+
+const Token& TokenVectorSource::peek() {
+    return tokens[index];
+}
+
+void TokenVectorSource::advance() {
+    if (index + 1 < tokens.size())
+        index++;
+}
+
+StreamScanner::StreamScanner(istream& in, size_t chunkSize)
+    : in(in), chunkSize(chunkSize), position(0), final(false), lineNumber(1),
+      current(END, "", 1) {
+    advance();
+}
+
+void StreamScanner::fill() {
+    buffer.erase(0, position);
+    position = 0;
+    size_t used = buffer.size();
+    buffer.resize(used + chunkSize);
+    in.read(&buffer[used], chunkSize);
+    buffer.resize(used + in.gcount());
+    if (in.gcount() == 0 || !in)
+        final = true;
+}
+
+const Token& StreamScanner::peek() {
+    return current;
+}
+
+void StreamScanner::advance() {
+    pending.clear();
+    while (pending.empty()) {
+        if (position == buffer.size()) {
+            if (final) {
+                pending.push_back(Token(END, "", lineNumber));
+                break;
+            }
+            fill();
+        } else if (!Scanner::lexNext(buffer, position, lineNumber, final, pending, cerr)) {
+            fill();
+        }
+    }
+    current = pending.back();
+}
@@ -1,7 +1,10 @@
 #ifndef SCANNER_H
 #define SCANNER_H
 
+#include <istream>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 enum TokenType {
@@ -25,33 +28,114 @@ enum TokenType {
     UNDEFINED
 };
 
+// A token's lexeme is a view into the scanner's input, so tokens are only
+// valid while the Scanner that produced them is alive.
 class Token {
 private:
     TokenType type;
-    std::string value;
+    std::string_view value;
     int lineNumber;
 
 public:
-    Token(TokenType type, std::string value, int lineNumber);
+    Token(TokenType type, std::string_view value, int lineNumber);
 
     TokenType getTokenType() const;
     std::string getTokenValue() const;
+    std::string_view getLexeme() const;
+    int getLineNumber() const;
     std::string toString() const;
 
 private:
     std::string tokenTypeToString(TokenType type) const;
 };
 
+class ThreadPool;
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+private:
+    const char* data;
+    size_t length;
+
+public:
+    explicit MappedFile(const std::string& path);
+    MappedFile(MappedFile&& other);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+    std::string_view contents() const;
+};
+
 class Scanner {
 private:
-    std::string input;
+    std::string ownedInput;
+    std::unique_ptr<MappedFile> mapping;
+    std::string_view input;
     std::vector<Token> tokens;
     int lineNumber;
 
 public:
     Scanner(const std::string& input);
+    Scanner(std::string&& input);
+    // Scans a memory-mapped file in place, without copying it.
+    Scanner(MappedFile&& file);
+    Scanner(const Scanner&) = delete;
+    Scanner& operator=(const Scanner&) = delete;
     void scan();
+    // Same tokens and warnings as scan(), with the input split into chunks
+    // of at least minChunkSize bytes that are lexed on the pool.
+    void scan(ThreadPool& pool, size_t minChunkSize = 1 << 18);
     const std::vector<Token>& getTokens() const;
+
+    // Lexes what starts at input[i]: whitespace, a comment or one token,
+    // which is appended to 'tokens'. Returns false, consuming nothing, when
+    // it may run past the end of 'input' and 'final' says more will follow.
+    static bool lexNext(std::string_view input, size_t& i, int& lineNumber, bool final,
+                        std::vector<Token>& tokens, std::ostream& warnings);
+};
+
+// Pull interface the parser reads tokens through.
+class TokenSource {
+public:
+    virtual ~TokenSource() {}
+    // The current token; its lexeme stays valid until the next advance().
+    virtual const Token& peek() = 0;
+    // Moves to the next token; END repeats once reached.
+    virtual void advance() = 0;
+};
+
+class TokenVectorSource : public TokenSource {
+private:
+    const std::vector<Token>& tokens;
+    size_t index;
+
+public:
+    TokenVectorSource(const std::vector<Token>& tokens);
+    const Token& peek() override;
+    void advance() override;
+};
+
+// Scans a stream on demand through a buffer that holds one chunk plus
+// whatever token is still open, so memory stays bounded on any input size.
+class StreamScanner : public TokenSource {
+private:
+    std::istream& in;
+    size_t chunkSize;
+    std::string buffer;
+    size_t position;
+    bool final;
+    int lineNumber;
+    std::vector<Token> pending;
+    Token current;
+
+    void fill();
+
+public:
+    StreamScanner(std::istream& in, size_t chunkSize = 1 << 16);
+    StreamScanner(const StreamScanner&) = delete;
+    StreamScanner& operator=(const StreamScanner&) = delete;
+    const Token& peek() override;
+    void advance() override;
 };
 
 #endif
@@ -0,0 +1,263 @@
+// Resident query server: evaluates a program once, then answers queries
+// against the evaluated relations until stopped.
+//
+//   g++ -std=c++17 -O2 -pthread -o server server.cpp scanner.cpp
+//   ./server [--threads N] [--socket PATH] [--save-snapshot PATH] [--profile PREFIX] [--explain]
+//            program.txt
+//   ./server [--threads N] [--socket PATH] --snapshot PATH
+//
+// Each request is one query per line, such as  path('a',X)?  and each
+// response is the answer as Query Evaluation prints it, or "Error: ..."
+// for a query that does not parse or names no relation, followed by a
+// line "# <microseconds> us" that ends it. Requests come from stdin, or
+// with --socket from any number of clients of a Unix socket at PATH.
+//
+// With --explain the rule evaluation summary goes to stderr, with the join
+// order each rule used and its estimated and actual sizes.
+// With --profile the evaluation of the program is profiled, and the
+// profile written to PREFIX.json and, as folded stacks, PREFIX.folded.
+// With --save-snapshot the evaluated program is also saved as a snapshot,
+// so that a later run can start from it with --snapshot instead of
+// evaluating again. A snapshot saved after demand-driven evaluation is
+// refused: its relations hold only the tuples its own queries needed.
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <shared_mutex>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "interpreter.cpp"
+
+using namespace std;
+
+// Answers queries on any number of threads at once. Evaluating a query
+// only reads the relations, except for building a missing index on its
+// constant columns, which is done under an exclusive lock first.
+class QueryServer {
+private:
+    const Interpreter& interpreter;
+    shared_mutex indexLock;
+    atomic<size_t> queryCount;
+    atomic<uint64_t> totalMicroseconds;
+    atomic<uint64_t> maxMicroseconds;
+
+    static Predicate parseQuery(const string& line) {
+        Scanner scanner(line);
+        scanner.scan();
+        Parser parser(scanner.getTokens());
+        Predicate query = parser.predicate();
+        parser.match(Q_MARK);
+        if (parser.current().getTokenType() != END)
+            throw runtime_error(parser.current().toString());
+        return query;
+    }
+    string evaluate(const Predicate& query) {
+        const Database& database = interpreter.getDatabase();
+        if (!database.hasRelation(query.name))
+            throw runtime_error("no relation named " + query.name);
+        const Relation& relation = database.getRelation(query.name);
+        if (relation.getScheme().size() != query.parameters.size())
+            throw runtime_error("wrong number of attributes for " + query.name);
+        AtomPlan atom = Interpreter::compileAtom(query, false);
+        if (atom.satisfiable) {
+            shared_lock<shared_mutex> reading(indexLock);
+            if (relation.hasIndexOn(atom.constantColumns))
+                return answer(query, atom, relation);
+        }
+        if (atom.satisfiable) {
+            unique_lock<shared_mutex> writing(indexLock);
+            relation.indexOn(atom.constantColumns);
+        }
+        shared_lock<shared_mutex> reading(indexLock);
+        return answer(query, atom, relation);
+    }
+    static string answer(const Predicate& query, const AtomPlan& atom, const Relation& relation) {
+        vector<Relation> materialized;
+        materialized.reserve(1);
+        const Relation* result = Interpreter::scanAtom(atom, relation, materialized);
+        return Interpreter::formatAnswer(query, *result, atom.scheme);
+    }
+    void record(uint64_t microseconds) {
+        queryCount++;
+        totalMicroseconds += microseconds;
+        uint64_t seen = maxMicroseconds;
+        while (microseconds > seen && !maxMicroseconds.compare_exchange_weak(seen, microseconds)) {}
+    }
+    static bool sendAll(int fd, const string& data) {
+        for (size_t sent = 0; sent < data.size(); ) {
+            ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                return false;
+            sent += n;
+        }
+        return true;
+    }
+    void serveClient(int fd) {
+        string pending;
+        char buffer[1 << 12];
+        ssize_t n;
+        while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+            pending.append(buffer, n);
+            string responses;
+            size_t start = 0;
+            for (size_t end; (end = pending.find('\n', start)) != string::npos; start = end + 1)
+                responses += answer(pending.substr(start, end - start));
+            pending.erase(0, start);
+            if (!sendAll(fd, responses))
+                break;
+        }
+        close(fd);
+    }
+
+public:
+    QueryServer(const Interpreter& interpreter)
+        : interpreter(interpreter), queryCount(0), totalMicroseconds(0), maxMicroseconds(0) {}
+
+    // The response to one request line; empty for a blank line.
+    string answer(const string& line) {
+        if (line.find_first_not_of(" \t\r") == string::npos)
+            return "";
+        auto start = chrono::steady_clock::now();
+        string response;
+        try {
+            response = evaluate(parseQuery(line));
+        } catch (const exception& e) {
+            response = string("Error: ") + e.what() + "\n";
+        }
+        uint64_t microseconds =
+            chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+        record(microseconds);
+        return response + "# " + to_string(microseconds) + " us\n";
+    }
+    void serveStream(istream& in, ostream& out) {
+        string line;
+        while (getline(in, line))
+            out << answer(line) << flush;
+    }
+    // Accepts clients until the process is stopped, each on its own thread.
+    // Returns only if the socket cannot be set up.
+    bool serveSocket(const string& path) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            cerr << "Socket path too long: " << path << endl;
+            return false;
+        }
+        strcpy(address.sun_path, path.c_str());
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(path.c_str());
+        if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            listen(listener, 64) != 0) {
+            cerr << "Could not listen on " << path << ": " << strerror(errno) << endl;
+            if (listener >= 0)
+                close(listener);
+            return false;
+        }
+        while (true) {
+            int client = accept(listener, nullptr, nullptr);
+            if (client < 0) {
+                if (errno == EINTR)
+                    continue;
+                cerr << "accept: " << strerror(errno) << endl;
+                close(listener);
+                return false;
+            }
+            thread(&QueryServer::serveClient, this, client).detach();
+        }
+    }
+    string summary() const {
+        size_t count = queryCount;
+        stringstream ss;
+        ss << count << " queries";
+        if (count > 0)
+            ss << ", mean " << totalMicroseconds / count << " us, max " << maxMicroseconds << " us";
+        return ss.str();
+    }
+};
+
+static int usage(const char* program) {
+    cerr << "usage: " << program << " [--threads N] [--socket PATH] [--save-snapshot PATH] [--profile PREFIX]"
+         << " [--explain] program.txt\n"
+         << "       " << program << " [--threads N] [--socket PATH] --snapshot PATH\n"
+         << "A snapshot saved in demand-driven mode is not accepted." << endl;
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    string programPath, snapshotPath, savePath, profilePrefix, socketPath;
+    size_t threads = 1;
+    bool explain = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            threads = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc)
+            socketPath = argv[++i];
+        else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc)
+            snapshotPath = argv[++i];
+        else if (strcmp(argv[i], "--save-snapshot") == 0 && i + 1 < argc)
+            savePath = argv[++i];
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+            profilePrefix = argv[++i];
+        else if (strcmp(argv[i], "--explain") == 0)
+            explain = true;
+        else if (programPath.empty() && argv[i][0] != '-')
+            programPath = argv[i];
+        else
+            return usage(argv[0]);
+    }
+    if (programPath.empty() == snapshotPath.empty() ||
+        ((!savePath.empty() || !profilePrefix.empty() || explain) && programPath.empty()))
+        return usage(argv[0]);
+
+    auto start = chrono::steady_clock::now();
+    Profiler profiler;
+    Interpreter interpreter;
+    interpreter.setThreadCount(threads);
+    if (!profilePrefix.empty())
+        interpreter.setProfiler(&profiler);
+    try {
+        if (!snapshotPath.empty()) {
+            interpreter.loadSnapshot(snapshotPath);
+            if (!interpreter.queriesReadOwnRelations()) {
+                cerr << "Snapshot was saved in demand-driven mode and cannot answer other queries: "
+                     << snapshotPath << endl;
+                return 1;
+            }
+        } else {
+            ifstream in(programPath, ios::binary);
+            if (!in) {
+                cerr << "Could not open file: " << programPath << endl;
+                return 1;
+            }
+            interpreter.loadStream(in);
+            // The evaluation output is not part of any response, so only
+            // counts are written, and those nowhere unless explaining.
+            interpreter.setOutputFormat(SUMMARY_OUTPUT);
+            interpreter.setExplain(explain);
+            streambuf* saved = cout.rdbuf(explain ? cerr.rdbuf() : nullptr);
+            interpreter.interpret();
+            cout.rdbuf(saved);
+            if (!profilePrefix.empty()) {
+                ofstream(profilePrefix + ".json", ios::binary) << profiler.toJson();
+                ofstream(profilePrefix + ".folded", ios::binary) << profiler.toFolded();
+            }
+            if (!savePath.empty())
+                interpreter.saveSnapshot(savePath);
+        }
+    } catch (const exception& e) {
+        cerr << "Failure!\n  " << e.what() << endl;
+        return 1;
+    }
+    cerr << "Ready in " << chrono::duration<double>(chrono::steady_clock::now() - start).count()
+         << "s" << endl;
+
+    QueryServer server(interpreter);
+    if (!socketPath.empty())
+        return server.serveSocket(socketPath) ? 0 : 1;
+    server.serveStream(cin, cout);
+    cerr << server.summary() << endl;
+    return 0;
+}
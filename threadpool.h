@@ -0,0 +1,119 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running one parallelFor at a time. The caller
+// works through the indices alongside the workers. A parallelFor issued
+// from inside a task, or while another one is running, runs inline, so
+// nested parallel operators cannot deadlock the pool.
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::mutex submitLock;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    const std::function<void(size_t)>* task;
+    size_t taskCount;
+    std::atomic<size_t> nextIndex;
+    size_t generation;
+    size_t busyWorkers;
+    bool stopping;
+    std::exception_ptr failure;
+
+    static bool& insideTask() {
+        thread_local bool inside = false;
+        return inside;
+    }
+    void drain() {
+        size_t index;
+        while ((index = nextIndex++) < taskCount) {
+            try {
+                (*task)(index);
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(lock);
+                if (!failure)
+                    failure = std::current_exception();
+            }
+        }
+    }
+    void workerLoop() {
+        insideTask() = true;
+        size_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [&] { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+            }
+            drain();
+            std::lock_guard<std::mutex> guard(lock);
+            if (--busyWorkers == 0)
+                finished.notify_all();
+        }
+    }
+
+public:
+    explicit ThreadPool(size_t threadCount)
+        : task(nullptr), taskCount(0), nextIndex(0), generation(0), busyWorkers(0), stopping(false) {
+        for (size_t i = 1; i < threadCount; i++)
+            workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const {
+        return workers.size() + 1;
+    }
+    static bool inTask() {
+        return insideTask();
+    }
+    // Calls body(i) for every i in [0, count), spread over the pool, and
+    // returns once all calls are done. Rethrows the first exception thrown.
+    void parallelFor(size_t count, const std::function<void(size_t)>& body) {
+        std::unique_lock<std::mutex> submitting(submitLock, std::defer_lock);
+        if (count <= 1 || workers.empty() || insideTask() || !submitting.try_lock()) {
+            for (size_t i = 0; i < count; i++)
+                body(i);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            task = &body;
+            taskCount = count;
+            nextIndex = 0;
+            failure = nullptr;
+            busyWorkers = workers.size();
+            ++generation;
+        }
+        wake.notify_all();
+        insideTask() = true;
+        drain();
+        insideTask() = false;
+        std::unique_lock<std::mutex> guard(lock);
+        finished.wait(guard, [&] { return busyWorkers == 0; });
+        task = nullptr;
+        if (failure)
+            std::rethrow_exception(failure);
+    }
+};
+
+#endif